@@ -47,98 +47,647 @@ static void dumpline(off_t ofs, uint16_t mask, uint8_t* bytes, off_t limit) {
 
 ////////////////////////////////////////////////////////////////////////////////
 
-int main(int argc, char** argv) {
-    int returncode = 0;
-    FILE* fa = NULL;
-    FILE* fb = NULL;
-    off_t ofs;
-    int8_t is_different = 0;
-    int longform = 0;
-    off_t    line_ofs = -1;
-    uint16_t line_mask = 0;
-    uint8_t  line_bytes[32];
+enum {
+    MODE_LINES,     // side-by-side, 16 bytes per line
+    MODE_LONG,      // one byte per line
+    MODE_RANGES,    // one line per run of differing bytes
+    MODE_SECTORS,   // one line per differing sector
+    MODE_COUNT,     // number of differing bytes only
+    MODE_QUIET      // nothing; stop at the first difference
+};
 
-    normalize_argv0(argv[0]);
+//
+// Differences are handed over one byte at a time, and whatever is being
+// collected (a 16-byte line, a run, a sector) is printed once a difference
+// turns up past it
+//
+// With -R, the file name is printed as a title before the first thing that's
+// reported for it.
+//
+struct report {
+    int         mode;
+    const char* title;
+    off_t       sectorsize;
+    off_t       count;
+    off_t       ofs;
+    off_t       end;
+    uint16_t    mask;
+    uint8_t     bytes[32];
+};
 
-    if(argc == 4) {
-        if(strcmp(argv[3], "-l")) { goto usage; }
-        longform = 1;
-    } else if(argc == 3) {
-        longform = 0;
+static void report_title(struct report* r, const char* separator) {
+    if(r->title) {
+        printf("%s:%s", r->title, separator);
+        r->title = NULL;
+    }
+}
+
+static void printbytes(off_t n) {
+    fprintdec(stdout, n);
+    printf(" byte%s", n == 1 ? "" : "s");
+}
+
+static void printdiffer(off_t n) {
+    printbytes(n);
+    printf(" differ%s\n", n == 1 ? "s" : "");
+}
+
+static void report_print(struct report* r, off_t limit) {
+    if(!r->count) { return; }
+    report_title(r, "\n");
+    switch(r->mode) {
+    case MODE_LINES:
+        if(limit > r->ofs + 0x10) { limit = r->ofs + 0x10; }
+        dumpline(r->ofs, r->mask, r->bytes, limit);
+        r->mask = 0;
+        break;
+    case MODE_RANGES:
+        fprinthex(stdout, r->ofs, 8);
+        printf("-");
+        fprinthex(stdout, r->end - 1, 8);
+        printf(": ");
+        printbytes(r->end - r->ofs);
+        printf("\n");
+        break;
+    case MODE_SECTORS:
+        fprinthex(stdout, r->ofs * r->sectorsize, 8);
+        printf(": sector ");
+        fprintdec(stdout, r->ofs);
+        printf(", ");
+        printdiffer(r->end);
+        break;
+    }
+    r->count = 0;
+}
+
+static void report_add(struct report* r, off_t ofs, uint8_t ca, uint8_t cb) {
+    switch(r->mode) {
+    case MODE_LINES:
+        if(r->count && ((ofs | 0xF) != (r->ofs | 0xF))) {
+            report_print(r, r->ofs + 0x10);
+        }
+        r->ofs = (ofs | 0xF) ^ 0xF;
+        r->mask |= 1 << (ofs & 0xF);
+        r->bytes[     (ofs & 0xF)] = ca;
+        r->bytes[16 + (ofs & 0xF)] = cb;
+        break;
+    case MODE_LONG:
+        report_title(r, "\n");
+        fprinthex(stdout, ofs, 8);
+        printf(": %02X %02X\n", (int)ca, (int)cb);
+        break;
+    case MODE_RANGES:
+        if(r->count && ofs != r->end) { report_print(r, ofs); }
+        if(!r->count) { r->ofs = ofs; }
+        r->end = ofs + 1;
+        break;
+    case MODE_SECTORS:
+        if(r->count && (ofs / r->sectorsize) != r->ofs) {
+            report_print(r, ofs);
+        }
+        if(!r->count) {
+            r->ofs = ofs / r->sectorsize;
+            r->end = 0;
+        }
+        r->end++;
+        break;
+    }
+    r->count++;
+}
+
+//
+// Print whatever is left; limit is where the shorter file ended, if it ended
+// within the last line
+//
+static void report_flush(struct report* r, off_t limit) {
+    if(r->mode == MODE_COUNT) {
+        if(r->count) {
+            report_title(r, " ");
+            printdiffer(r->count);
+        }
     } else {
-        goto usage;
+        report_print(r, limit);
     }
+}
 
-    if(!strcmp(argv[1], argv[2])) {
-        printf("You specified the same file\n");
-        goto done;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Compare one block of both files
+//
+// Identical spans are skipped 64 bytes at a time with memcmp, which the C
+// library already does at close to memory speed; only spans that differ are
+// looked at byte by byte.
+//
+static const size_t SPAN = 64;
+
+static int compareblock(
+    struct report* r,
+    off_t          base,
+    const uint8_t* a,
+    const uint8_t* b,
+    size_t         n
+) {
+    int is_different = 0;
+    size_t i = 0;
+    if(!memcmp(a, b, n)) { return 0; }
+    if(r->mode == MODE_QUIET) { return 1; }
+    while(i < n) {
+        size_t end;
+        if((n - i) >= SPAN && !memcmp(a + i, b + i, SPAN)) {
+            i += SPAN;
+            continue;
+        }
+        end = ((n - i) >= SPAN) ? (i + SPAN) : n;
+        for(; i < end; i++) {
+            if(a[i] != b[i]) {
+                report_add(r, base + (off_t)i, a[i], b[i]);
+                is_different = 1;
+            }
+        }
     }
+    return is_different;
+}
 
-    fa = fopen(argv[1], "rb");
+//
+// Read as much of a block as the file has left
+// Returns the number of bytes read, or -1 on error
+//
+static long readblock(FILE* f, uint8_t* buf, size_t size) {
+    size_t n = fread(buf, 1, size, f);
+    if(n < size && ferror(f)) { return -1; }
+    return (long)n;
+}
+
+//
+// For -q: regular files of different sizes can't match, so there's no need
+// to read them
+//
+static int sizesdiffer(const char* name1, const char* name2) {
+    struct stat s1;
+    struct stat s2;
+    if(stat(name1, &s1) < 0 || stat(name2, &s2) < 0) { return 0; }
+    if(!S_ISREG(s1.st_mode) || !S_ISREG(s2.st_mode)) { return 0; }
+    return s1.st_size != s2.st_size;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+//
+// Allocated once in main; two static 32K buffers would be too much data for
+// one module in the DOS builds
+//
+enum { BUFFER_SIZE = 0x8000 };
+
+static uint8_t* buf_a = NULL;
+static uint8_t* buf_b = NULL;
+
+//
+// Compare two files
+// Returns 0 if they match, 1 if they differ, or -1 on error
+//
+static int comparefiles(
+    struct report* r,
+    const char*    name1,
+    const char*    name2
+) {
+    int is_different = 0;
+    FILE* fa = NULL;
+    FILE* fb = NULL;
+    off_t ofs;
+
+    r->count = 0;
+    r->mask  = 0;
+
+    fa = fopen(name1, "rb");
     if(!fa) { goto error_fa; }
 
-    fb = fopen(argv[2], "rb");
+    fb = fopen(name2, "rb");
     if(!fb) { goto error_fb; }
 
-    for(ofs = 0;; ofs++) {
-        int ca;
-        int cb;
-
-        if(line_mask && ((ofs | 0xF) != (line_ofs | 0xF))) {
-            dumpline(line_ofs, line_mask, line_bytes, line_ofs + 0x10);
-            line_mask = 0;
-        }
+    for(ofs = 0;;) {
+        long na;
+        long nb;
+        long n;
 
-        ca = fgetc(fa);
-        if(ca == EOF && ferror(fa)) { goto error_fa; }
+        na = readblock(fa, buf_a, BUFFER_SIZE);
+        if(na < 0) { goto error_fa; }
 
-        cb = fgetc(fb);
-        if(cb == EOF && ferror(fb)) { goto error_fb; }
+        nb = readblock(fb, buf_b, BUFFER_SIZE);
+        if(nb < 0) { goto error_fb; }
 
-        is_different |= (ca != cb);
+        n = (na < nb) ? na : nb;
+        if(compareblock(r, ofs, buf_a, buf_b, (size_t)n)) {
+            is_different = 1;
+            if(r->mode == MODE_QUIET) { break; }
+        }
+        ofs += n;
 
-        if(ca == EOF && cb != EOF) {
-            if(line_mask) { dumpline(line_ofs, line_mask, line_bytes, ofs); }
-            printf("%s is longer than %s\n", argv[2], argv[1]);
+        if(na != nb) {
+            is_different = 1;
+            if(r->mode == MODE_QUIET) { break; }
+            report_flush(r, ofs);
+            report_title(r, " ");
+            printf("%s is longer than %s\n",
+                (na < nb) ? name2 : name1,
+                (na < nb) ? name1 : name2
+            );
             break;
         }
-        if(cb == EOF && ca != EOF) {
-            if(line_mask) { dumpline(line_ofs, line_mask, line_bytes, ofs); }
-            printf("%s is longer than %s\n", argv[1], argv[2]);
+        if(na < (long)BUFFER_SIZE) {
+            report_flush(r, ofs);
             break;
         }
-        if(ca == EOF && cb == EOF) {
-            if(line_mask) { dumpline(line_ofs, line_mask, line_bytes, ofs); }
-            break;
+    }
+    goto done;
+
+error_fa:
+    report_title(r, " ");
+    printfileerror(fa, name1);
+    goto error;
+error_fb:
+    report_title(r, " ");
+    printfileerror(fb, name2);
+    goto error;
+error:
+    is_different = -1;
+done:
+    if(fa != NULL) { fclose(fa); }
+    if(fb != NULL) { fclose(fb); }
+    return is_different;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Directory trees, for -R
+//
+// Every file and subdirectory under the root goes into one list, by its path
+// relative to the root.  The list doubles as the queue of directories still
+// to be read.
+//
+struct treeentry {
+    char* name;
+    int   isdir;
+    off_t size;
+};
+
+struct tree {
+    const char*       root;
+    const char*       prefix;
+    struct treeentry* entry;
+    size_t            n;
+    size_t            max;
+};
+
+static char* joinpath(const char* a, const char* b) {
+    char* s = malloc(strlen(a) + strlen(b) + 2);
+    if(!s) { return NULL; }
+    strcpy(s, a);
+    strcat(s, "/");
+    strcat(s, b);
+    return s;
+}
+
+static int tree_add(void* context, const char* name) {
+    struct tree* tree = (struct tree*)context;
+    struct treeentry* e;
+    struct stat mystat;
+    char* full;
+    if(tree->n >= tree->max) {
+        size_t newmax = tree->max ? (tree->max * 2) : 64;
+        struct treeentry* newentry;
+        if(newmax > ((size_t)-1) / sizeof(struct treeentry)) { goto error_mem; }
+        newentry = realloc(tree->entry, newmax * sizeof(struct treeentry));
+        if(!newentry) { goto error_mem; }
+        tree->entry = newentry;
+        tree->max   = newmax;
+    }
+    e = tree->entry + tree->n;
+    if(tree->prefix) {
+        e->name = joinpath(tree->prefix, name);
+    } else {
+        e->name = malloc(strlen(name) + 1);
+        if(e->name) { strcpy(e->name, name); }
+    }
+    if(!e->name) { goto error_mem; }
+    full = joinpath(tree->root, e->name);
+    if(!full) { free(e->name); goto error_mem; }
+    e->isdir = 0;
+    e->size  = -1;
+    if(lstat(full, &mystat) >= 0) {
+        //
+        // Follow links to files, but not to directories, which could loop
+        //
+        if(S_ISLNK(mystat.st_mode) && stat(full, &mystat) >= 0) {
+            if(S_ISDIR(mystat.st_mode)) {
+                free(e->name);
+                free(full);
+                return 0;
+            }
+        }
+        e->isdir = S_ISDIR(mystat.st_mode);
+        e->size  = mystat.st_size;
+    }
+    free(full);
+    tree->n++;
+    return 0;
+
+error_mem:
+    printf("Out of memory\n");
+    return 1;
+}
+
+static int tree_compare(const void* a, const void* b) {
+    return strcmp(
+        ((const struct treeentry*)a)->name,
+        ((const struct treeentry*)b)->name
+    );
+}
+
+static void tree_free(struct tree* tree) {
+    size_t i;
+    for(i = 0; i < tree->n; i++) { free(tree->entry[i].name); }
+    free(tree->entry);
+    tree->entry = NULL;
+    tree->n     = 0;
+    tree->max   = 0;
+}
+
+//
+// Read a whole tree, and sort its files by name
+// Returns 0 on success, or -1 on error
+//
+static int tree_read(struct tree* tree, const char* root) {
+    size_t i;
+    size_t nfiles;
+    char* dir = NULL;
+    int r;
+    memset(tree, 0, sizeof(*tree));
+    tree->root = root;
+    r = foreachdirentry(root, tree_add, tree);
+    if(r) { goto error_dir; }
+    for(i = 0; i < tree->n; i++) {
+        if(!tree->entry[i].isdir) { continue; }
+        dir = joinpath(root, tree->entry[i].name);
+        if(!dir) { goto error_mem; }
+        tree->prefix = tree->entry[i].name;
+        r = foreachdirentry(dir, tree_add, tree);
+        if(r) { goto error_dir; }
+        free(dir);
+        dir = NULL;
+    }
+    //
+    // Keep only the files
+    //
+    for(i = 0, nfiles = 0; i < tree->n; i++) {
+        if(tree->entry[i].isdir) {
+            free(tree->entry[i].name);
+        } else {
+            tree->entry[nfiles++] = tree->entry[i];
         }
-        if(ca != cb) {
-            if(longform) {
-                fprinthex(stdout, ofs, 8);
-                printf(": %02X %02X\n", ca, cb);
+    }
+    tree->n = nfiles;
+    qsort(tree->entry, tree->n, sizeof(struct treeentry), tree_compare);
+    return 0;
+
+error_mem:
+    printf("Out of memory\n");
+    goto error;
+error_dir:
+    if(r < 0) {
+        printf("Error: %s: %s\n", dir ? dir : root, strerror(errno));
+    }
+error:
+    if(dir) { free(dir); }
+    tree_free(tree);
+    return -1;
+}
+
+//
+// Ask the OS to start reading both files of a pair that will be compared soon
+//
+static const off_t READAHEAD_MAX = 0x4000000L;
+
+static void prefetchpair(
+    struct tree*      ta,
+    struct tree*      tb,
+    struct treeentry* a
+) {
+    off_t size = (a->size < READAHEAD_MAX) ? a->size : READAHEAD_MAX;
+    char* name;
+    name = joinpath(ta->root, a->name);
+    if(name) { prefetchfile(name, size); free(name); }
+    name = joinpath(tb->root, a->name);
+    if(name) { prefetchfile(name, size); free(name); }
+}
+
+//
+// Compare two directory trees
+//
+// Files are paired by name.  Pairs whose sizes differ are reported without
+// reading them.  With depth > 1, the next few pairs to be compared are read
+// ahead while the current one is compared.
+//
+// Returns 0 if the trees match, 1 if they differ, or -1 on error
+//
+static int comparetrees(
+    struct report* r,
+    const char*    dir1,
+    const char*    dir2,
+    size_t         depth
+) {
+    struct tree ta;
+    struct tree tb;
+    size_t ia = 0, ib = 0;
+    size_t ahead_a = 0, ahead_b = 0;
+    size_t nfiles = 0;
+    size_t ndiffer = 0;
+    int returncode = 0;
+
+    if(tree_read(&ta, dir1)) { return -1; }
+    if(tree_read(&tb, dir2)) { tree_free(&ta); return -1; }
+
+    while(ia < ta.n || ib < tb.n) {
+        struct treeentry* a = (ia < ta.n) ? (ta.entry + ia) : NULL;
+        struct treeentry* b = (ib < tb.n) ? (tb.entry + ib) : NULL;
+        int c = (!a) ? 1 : (!b) ? -1 : strcmp(a->name, b->name);
+        int result;
+        nfiles++;
+        if(c < 0) {
+            if(r->mode != MODE_QUIET) {
+                printf("Only in %s: %s\n", dir1, a->name);
+            }
+            ia++;
+            result = 1;
+        } else if(c > 0) {
+            if(r->mode != MODE_QUIET) {
+                printf("Only in %s: %s\n", dir2, b->name);
+            }
+            ib++;
+            result = 1;
+        } else if(a->size != b->size) {
+            if(r->mode != MODE_QUIET) { printf("%s: sizes differ\n", a->name); }
+            ia++;
+            ib++;
+            result = 1;
+        } else {
+            char* name1 = joinpath(dir1, a->name);
+            char* name2 = joinpath(dir2, b->name);
+            //
+            // Read ahead, skipping pairs that won't be compared
+            //
+            if(depth > 1) {
+                if(ahead_a < ia) { ahead_a = ia; ahead_b = ib; }
+                while(
+                    ahead_a < ta.n && ahead_b < tb.n && ahead_a < ia + depth
+                ) {
+                    struct treeentry* pa = ta.entry + ahead_a;
+                    struct treeentry* pb = tb.entry + ahead_b;
+                    int pc = strcmp(pa->name, pb->name);
+                    if(pc < 0) { ahead_a++; continue; }
+                    if(pc > 0) { ahead_b++; continue; }
+                    if(pa->size == pb->size) { prefetchpair(&ta, &tb, pa); }
+                    ahead_a++;
+                    ahead_b++;
+                }
+            }
+            if(!name1 || !name2) {
+                printf("Out of memory\n");
+                result = -1;
             } else {
-                line_ofs = (ofs | 0xF) ^ 0xF;
-                line_mask |= 1 << (ofs & 0xF);
-                line_bytes[     (ofs & 0xF)] = (uint8_t)ca;
-                line_bytes[16 + (ofs & 0xF)] = (uint8_t)cb;
+                r->title = a->name;
+                result = comparefiles(r, name1, name2);
+                r->title = NULL;
             }
+            free(name1);
+            free(name2);
+            ia++;
+            ib++;
         }
+        if(result) {
+            ndiffer++;
+            if(result < 0 || returncode == 0) { returncode = result; }
+            if(r->mode == MODE_QUIET) { break; }
+        }
+    }
 
+    if(r->mode != MODE_QUIET) {
+        if(!ndiffer) {
+            printf("Files match\n");
+        } else {
+            fprintdec(stdout, ndiffer);
+            printf(" of ");
+            fprintdec(stdout, nfiles);
+            printf(" files differ\n");
+        }
     }
-    if(!is_different) {
-        printf("Files match\n");
+
+    tree_free(&ta);
+    tree_free(&tb);
+    return returncode;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char** argv) {
+    int returncode = 0;
+    const char* name1 = NULL;
+    const char* name2 = NULL;
+    int recurse = 0;
+    size_t depth = 1;
+    struct report r;
+    int i;
+
+    normalize_argv0(argv[0]);
+
+    memset(&r, 0, sizeof(r));
+    r.mode = MODE_LINES;
+
+    for(i = 1; i < argc; i++) {
+        if(!strcmp(argv[i], "-l")) {
+            r.mode = MODE_LONG;
+        } else if(!strcmp(argv[i], "-r")) {
+            r.mode = MODE_RANGES;
+        } else if(!strcmp(argv[i], "-c")) {
+            r.mode = MODE_COUNT;
+        } else if(!strcmp(argv[i], "-q")) {
+            r.mode = MODE_QUIET;
+        } else if(!strcmp(argv[i], "-R")) {
+            recurse = 1;
+        } else if(!strcmp(argv[i], "-sector") && (i + 1) < argc) {
+            r.mode = MODE_SECTORS;
+            r.sectorsize = strtoofft(argv[++i], NULL, 0);
+            if(r.sectorsize <= 0) {
+                printf("Error: Invalid sector size\n");
+                goto error;
+            }
+        } else if(!strcmp(argv[i], "-j") && (i + 1) < argc) {
+            char *end;
+            unsigned long j = strtoul(argv[++i], &end, 10);
+            if(*end || j < 1) {
+                printf("Error: Invalid -j value: %s\n", argv[i]);
+                goto error;
+            }
+            depth = j;
+        } else if(!name1) {
+            name1 = argv[i];
+        } else if(!name2) {
+            name2 = argv[i];
+        } else {
+            goto usage;
+        }
     }
+    if(!name2) { goto usage; }
 
-    returncode = is_different;
-    goto done;
+    if(!strcmp(name1, name2)) {
+        if(r.mode != MODE_QUIET) { printf("You specified the same file\n"); }
+        goto done;
+    }
+
+    buf_a = malloc(BUFFER_SIZE);
+    buf_b = malloc(BUFFER_SIZE);
+    if(!buf_a || !buf_b) {
+        printf("Out of memory\n");
+        goto error;
+    }
+
+    if(recurse) {
+        //
+        // Across a whole tree, show a count per file unless told otherwise
+        //
+        if(r.mode == MODE_LINES) { r.mode = MODE_COUNT; }
+        returncode = comparetrees(&r, name1, name2, depth);
+        if(returncode < 0) { goto error; }
+        goto done;
+    }
+
+    if(r.mode == MODE_QUIET && sizesdiffer(name1, name2)) {
+        returncode = 1;
+        goto done;
+    }
 
-error_fa: printfileerror(fa, argv[1]); goto error;
-error_fb: printfileerror(fb, argv[2]); goto error;
+    returncode = comparefiles(&r, name1, name2);
+    if(returncode < 0) { goto error; }
+    if(!returncode && r.mode != MODE_QUIET) {
+        printf("Files match\n");
+    }
+    goto done;
 
 usage:
     banner();
     printf(
-        "Usage: %s file1 file2 [-l]\n"
-        "  -l   Use long format\n",
+        "Usage: %s file1 file2 [options]\n"
+        "       %s -R dir1 dir2 [options]\n"
+        "  -l          Use long format\n"
+        "  -r          Show each run of differing bytes\n"
+        "  -sector n   Show each n-byte sector that differs\n"
+        "  -c          Show only the number of differing bytes\n"
+        "              (default with -R)\n"
+        "  -q          Show nothing; stop at the first difference\n"
+        "  -R          Compare every file in two directory trees\n"
+        "  -j n        With -R, have the OS read ahead, up to n pairs including\n"
+        "              the current one (default 1)\n"
+        "The exit code is 0 if the files match, and 1 if not.\n",
+        argv[0],
         argv[0]
     );
     goto error;
@@ -147,8 +696,8 @@ error:
     returncode = 1;
 
 done:
-    if(fa != NULL) { fclose(fa); }
-    if(fb != NULL) { fclose(fb); }
+    if(buf_a != NULL) { free(buf_a); }
+    if(buf_b != NULL) { free(buf_b); }
     return returncode;
 }
 
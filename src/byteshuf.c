@@ -23,6 +23,86 @@
 
 ////////////////////////////////////////////////////////////////////////////////
 
+//
+// Interleave n subfile rows, each "rows" bytes long and "stride" bytes apart in
+// sub, into out; or the reverse
+//
+// 2 and 4 ways get their own loops with constant strides, which compilers
+// unroll and vectorize; anything else goes one row at a time.
+//
+static void interleave(
+    uint8_t*       out,
+    const uint8_t* sub,
+    size_t         stride,
+    size_t         n,
+    size_t         rows
+) {
+    size_t r;
+    size_t i;
+    switch(n) {
+    case 2:
+        for(r = 0; r < rows; r++) {
+            out[2 * r    ] = sub[         r];
+            out[2 * r + 1] = sub[stride + r];
+        }
+        break;
+    case 4:
+        for(r = 0; r < rows; r++) {
+            out[4 * r    ] = sub[             r];
+            out[4 * r + 1] = sub[    stride + r];
+            out[4 * r + 2] = sub[2 * stride + r];
+            out[4 * r + 3] = sub[3 * stride + r];
+        }
+        break;
+    default:
+        for(i = 0; i < n; i++) {
+            const uint8_t* s = sub + i * stride;
+            uint8_t* o = out + i;
+            for(r = 0; r < rows; r++) { o[r * n] = s[r]; }
+        }
+        break;
+    }
+}
+
+static void deinterleave(
+    uint8_t*       sub,
+    const uint8_t* in,
+    size_t         stride,
+    size_t         n,
+    size_t         rows
+) {
+    size_t r;
+    size_t i;
+    switch(n) {
+    case 2:
+        for(r = 0; r < rows; r++) {
+            sub[         r] = in[2 * r    ];
+            sub[stride + r] = in[2 * r + 1];
+        }
+        break;
+    case 4:
+        for(r = 0; r < rows; r++) {
+            sub[             r] = in[4 * r    ];
+            sub[    stride + r] = in[4 * r + 1];
+            sub[2 * stride + r] = in[4 * r + 2];
+            sub[3 * stride + r] = in[4 * r + 3];
+        }
+        break;
+    default:
+        for(i = 0; i < n; i++) {
+            uint8_t* s = sub + i * stride;
+            const uint8_t* p = in + i;
+            for(r = 0; r < rows; r++) { s[r] = p[r * n]; }
+        }
+        break;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Files are moved in blocks: each subfile gets a row of up to "stride" bytes,
+// and the main file a block of that many rows interleaved, about 32K in all.
+//
 static int shuffle(
     int shuffling,
     const char* mainfile,
@@ -32,10 +112,19 @@ static int shuffle(
 ) {
     int returncode = 0;
     size_t i;
-    int* chars = calloc(1, sizeof(int) * subfiles_count);
+    size_t stride = (subfiles_count < 0x8000) ? (0x8000 / subfiles_count) : 1;
+    size_t* got = calloc(1, sizeof(size_t) * subfiles_count);
+    uint8_t* mainbuf = NULL;
+    uint8_t* subbuf = NULL;
     FILE* mf = NULL;
     FILE** sf = calloc(1, sizeof(FILE*) * subfiles_count);
-    if(!sf || !chars) {
+    if(subfiles_count > ((size_t)-1) / stride) {
+        printf("Error: Out of memory\n");
+        goto error;
+    }
+    mainbuf = malloc(stride * subfiles_count);
+    subbuf  = malloc(stride * subfiles_count);
+    if(!sf || !got || !mainbuf || !subbuf) {
         printf("Error: Out of memory\n");
         goto error;
     }
@@ -83,25 +172,33 @@ static int shuffle(
         if(!mf) { goto error_mf; }
         clearerr(mf);
 
+        //
+        // Subfiles that run out early are filled with zeroes, but the last
+        // row only goes as far as the last subfile that had a byte for it
+        //
         for(;;) {
+            size_t rows = 0;
             size_t num_chars = 0;
+            size_t size;
             for(i = 0; i < subfiles_count; i++) {
-                chars[i] = fgetc(sf[i]);
-                if(chars[i] == EOF) {
-                    if(ferror(sf[i])) { goto error_sf_i; }
-                    chars[i] = 0;
+                got[i] = fread(subbuf + i * stride, 1, stride, sf[i]);
+                if(got[i] < stride && ferror(sf[i])) { goto error_sf_i; }
+                if(got[i] > rows) { rows = got[i]; }
+            }
+            if(!rows) { break; }
+            for(i = 0; i < subfiles_count; i++) {
+                if(got[i] < rows) {
+                    memset(subbuf + i * stride + got[i], 0, rows - got[i]);
                 } else {
-                    chars[i] &= 0xFF;
                     num_chars = i + 1;
                 }
             }
-            if(!num_chars) { break; }
             for(i = num_chars_last; i < subfiles_count; i++) {
                 if(fputc(0, mf) == EOF) { goto error_mf; }
             }
-            for(i = 0; i < num_chars; i++) {
-                if(fputc(chars[i], mf) == EOF) { goto error_mf; }
-            }
+            interleave(mainbuf, subbuf, stride, subfiles_count, rows);
+            size = (rows - 1) * subfiles_count + num_chars;
+            if(fwrite(mainbuf, 1, size, mf) != size) { goto error_mf; }
             num_chars_last = num_chars;
         }
     } else {
@@ -121,15 +218,21 @@ static int shuffle(
         }
 
         for(;;) {
+            size_t size = fread(mainbuf, 1, stride * subfiles_count, mf);
+            size_t rows;
+            if(size < stride * subfiles_count && ferror(mf)) { goto error_mf; }
+            if(!size) { break; }
+            rows = (size + subfiles_count - 1) / subfiles_count;
+            memset(mainbuf + size, 0, rows * subfiles_count - size);
+            deinterleave(subbuf, mainbuf, stride, subfiles_count, rows);
             for(i = 0; i < subfiles_count; i++) {
-                int c = fgetc(mf);
-                if(c == EOF) {
-                    if(ferror(mf)) { goto error_mf; }
-                    break;
+                size_t n = (size / subfiles_count) +
+                    ((i < (size % subfiles_count)) ? 1 : 0);
+                if(fwrite(subbuf + i * stride, 1, n, sf[i]) != n) {
+                    goto error_sf_i;
                 }
-                if(fputc(c & 0xFF, sf[i]) == EOF) { goto error_sf_i; }
             }
-            if(i < subfiles_count) { break; }
+            if(size < stride * subfiles_count) { break; }
         }
     }
     goto done;
@@ -151,7 +254,9 @@ done:
         }
         free(sf);
     }
-    if(chars) { free(chars); }
+    if(got) { free(got); }
+    if(mainbuf) { free(mainbuf); }
+    if(subbuf) { free(subbuf); }
     return returncode;
 }
 
@@ -23,43 +23,107 @@
 
 ////////////////////////////////////////////////////////////////////////////////
 
-static int byteswap(
-    const char* filename,
+//
+// Reverse each record in a buffer
+//
+// Records of 2, 4, and 8 bytes are swapped a 32-bit word at a time; these
+// shift-and-mask forms come out the same on either byte order, and compilers
+// turn them into bswap or vector shuffles.  Anything else, and whatever's left
+// over at the end, goes through the plain two-pointer loop.
+//
+static void swap_any(uint8_t* buf, size_t size, size_t recordsize) {
+    size_t rec;
+    for(rec = 0; rec < size; rec += recordsize) {
+        size_t a = rec;
+        size_t b = rec + recordsize - 1;
+        for(; a < b; a++, b--) {
+            uint8_t t = buf[a];
+            buf[a] = buf[b];
+            buf[b] =  t;
+        }
+    }
+}
+
+static uint32_t swappairs(uint32_t x) {
+    const uint32_t m = 0x00FF00FF;
+    return ((x & m) << 8) | ((x >> 8) & m);
+}
+
+static uint32_t reverse32(uint32_t x) {
+    x = swappairs(x);
+    return (x << 16) | (x >> 16);
+}
+
+static void swap2(uint8_t* buf, size_t size) {
+    size_t i;
+    for(i = 0; (size - i) >= 4; i += 4) {
+        uint32_t x;
+        memcpy(&x, buf + i, 4);
+        x = swappairs(x);
+        memcpy(buf + i, &x, 4);
+    }
+    swap_any(buf + i, size - i, 2);
+}
+
+static void swap4(uint8_t* buf, size_t size) {
+    size_t i;
+    for(i = 0; i < size; i += 4) {
+        uint32_t x;
+        memcpy(&x, buf + i, 4);
+        x = reverse32(x);
+        memcpy(buf + i, &x, 4);
+    }
+}
+
+static void swap8(uint8_t* buf, size_t size) {
+    size_t i;
+    for(i = 0; i < size; i += 8) {
+        uint32_t x;
+        uint32_t y;
+        memcpy(&x, buf + i    , 4);
+        memcpy(&y, buf + i + 4, 4);
+        x = reverse32(x);
+        y = reverse32(y);
+        memcpy(buf + i    , &y, 4);
+        memcpy(buf + i + 4, &x, 4);
+    }
+}
+
+static void swaprecords(uint8_t* buf, size_t size, size_t recordsize) {
+    switch(recordsize) {
+    case 2: swap2(buf, size); break;
+    case 4: swap4(buf, size); break;
+    case 8: swap8(buf, size); break;
+    default: swap_any(buf, size, recordsize); break;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Swap every record from one stream to another
+//
+// The buffer size is a multiple of the record size, so records never straddle
+// two buffers.  A short last record is filled out with zeroes.
+//
+// Returns 0 on success, 1 if reading failed, or 2 if writing failed
+//
+static int swapstream(
+    FILE* in,
+    FILE* out,
     uint8_t* buf,
     size_t buffersize,
-    size_t recordsize,
-    int quiet
+    size_t recordsize
 ) {
-    int returncode = 0;
-    FILE* f = NULL;
-
-    f = fopen(filename, "r+b");
-    if(!f) { goto error_f; }
-
     for(;;) {
-        size_t rec;
         size_t size;
+        size_t got;
         //
         // Read
         //
-        clearerr(f);
-        size = fread(buf, 1, buffersize, f);
-        if(size == 0) {
-            // Check for error
-            if(ferror(f)) {
-                goto error_f;
-            }
-            // Otherwise, done
-            break;
-        }
-        //
-        // Seek backwards
-        //
-        if(fseeko(f, -((off_t)size), SEEK_CUR) != 0) {
-            goto error_f;
-        }
+        size = got = fread(buf, 1, buffersize, in);
+        if(got < buffersize && ferror(in)) { return 1; }
+        if(got == 0) { break; }
 
-        if(size > buffersize) { size = buffersize; }
         if(size < buffersize) {
             //
             // Round up to the next record, filling with zeroes as we go
@@ -71,44 +135,115 @@ static int byteswap(
                 }
             }
         }
+        swaprecords(buf, size, recordsize);
         //
-        // Reverse each record in memory
+        // Write
         //
-        for(rec = 0; rec < size; rec += recordsize) {
-            size_t a = rec;
-            size_t b = rec + recordsize - 1;
-            for(; a < b; a++, b--) {
-                uint8_t t = buf[a];
-                buf[a] = buf[b];
-                buf[b] =  t;
-            }
-        }
+        if(fwrite(buf, 1, size, out) != size) { return 2; }
         //
-        // Write
+        // A short read was the end of the input; stop here rather than read
+        // back any padding that was just written
         //
-        if(fwrite(buf, 1, size, f) != size) {
-            goto error_f;
-        }
-        fflush(f);
+        if(got < buffersize) { break; }
     }
+    return 0;
+}
 
-    if(!quiet) {
-        printf("%s: Done\n", filename);
+//
+// Swap one file, either in place (outname is NULL) or into another file
+// "-" stands for stdin or stdout
+//
+// In place, the file is opened twice: once to read from, and once to write
+// back to the same place.  The writer trails the reader, so neither one has
+// to seek.
+//
+static int byteswap(
+    const char* inname,
+    const char* outname,
+    uint8_t* buf,
+    size_t buffersize,
+    size_t recordsize,
+    int quiet
+) {
+    int returncode = 0;
+    FILE* f = NULL;
+    FILE* fw = NULL;
+    int in_std = !strcmp(inname, "-");
+    int out_std;
+
+    if(!outname) { outname = in_std ? "-" : inname; }
+    out_std = !strcmp(outname, "-");
+
+    if(in_std) {
+        f = stdin;
+        setbinarymode(f);
+    } else {
+        f = fopen(inname, "rb");
+        if(!f) { goto error_f; }
+    }
+
+    if(out_std) {
+        fw = stdout;
+        setbinarymode(fw);
+    } else {
+        //
+        // Opening the input with "wb" would truncate it, so a name that
+        // refers to the same file is swapped in place
+        //
+        fw = fopen(outname, (in_std || !samefile(inname, outname)) ? "wb" : "r+b");
+        if(!fw) { goto error_fw; }
+    }
+
+    switch(swapstream(f, fw, buf, buffersize, recordsize)) {
+    case 1: goto error_f;
+    case 2: goto error_fw;
+    }
+
+    if(out_std ? fflush(fw) : fclose(fw)) {
+        if(!out_std) { fw = NULL; }
+        goto error_fw;
+    }
+    if(!out_std) { fw = NULL; }
+
+    //
+    // Don't mix messages into the output
+    //
+    if(!quiet && !out_std) {
+        printf("%s: Done\n", inname);
     }
     goto done;
 
 error_f:
-    printfileerror(f, filename);
+    printfileerror(f, inname);
+    goto error;
+
+error_fw:
+    printfileerror(fw, outname);
     goto error;
 
 error:
     returncode = 1;
 
 done:
-    if(f != NULL) { fclose(f); }
+    if(f  != NULL && !in_std ) { fclose(f ); }
+    if(fw != NULL && !out_std) { fclose(fw); }
     return returncode;
 }
 
+//
+// Ask the OS to start reading a file that will be swapped soon
+//
+static const off_t READAHEAD_MAX = 0x4000000L;
+
+static void byteswap_prefetch(const char* filename) {
+    struct stat mystat;
+    if(!strcmp(filename, "-")) { return; }
+    if(stat(filename, &mystat) < 0) { return; }
+    prefetchfile(filename,
+        (mystat.st_size < READAHEAD_MAX) ? mystat.st_size : READAHEAD_MAX
+    );
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 int main(int argc, char** argv) {
@@ -117,10 +252,13 @@ int main(int argc, char** argv) {
     unsigned long recordsize_max = (sizeof(size_t) < sizeof(unsigned long)) ?
         ((unsigned long)((size_t)(-1))) : LONG_MAX;
     int quiet = 0;
+    const char* outname = NULL;
+    unsigned long depth = 1;
     int i;
+    int j;
     uint8_t* buf = NULL;
     size_t buffersize = 0;
-    size_t buffersize_min = 8192;
+    size_t buffersize_min = 0x8000;
 
     normalize_argv0(argv[0]);
 
@@ -129,7 +267,7 @@ int main(int argc, char** argv) {
     //
     if(argc == 1) { goto usage; }
     for(i = 1; i < argc; i++) {
-        if(argv[i][0] == '-') {
+        if(argv[i][0] == '-' && argv[i][1] != 0) {
             // An option
             if(argv[i][1] == '-' && argv[i][2] == 0) {
                 // No more options
@@ -150,6 +288,23 @@ int main(int argc, char** argv) {
                 if(!isdigit((int)(argv[i][0]))) { goto usage; }
                 recordsize = strtoul(argv[i], NULL, 0);
                 continue;
+            } else if(argv[i][1] == 'o' && argv[i][2] == 0) {
+                // Output file
+                i++;
+                if(i >= argc) { goto usage; }
+                outname = argv[i];
+                continue;
+            } else if(argv[i][1] == 'j' && argv[i][2] == 0) {
+                // Files to read ahead
+                char* end;
+                i++;
+                if(i >= argc) { goto usage; }
+                depth = strtoul(argv[i], &end, 10);
+                if(*end || !isdigit((int)(argv[i][0])) || depth < 1) {
+                    printf("Error: Invalid -j value: %s\n", argv[i]);
+                    goto error;
+                }
+                continue;
             }
             printf("Unknown option: %s\n", argv[i]);
             goto usage;
@@ -163,6 +318,10 @@ int main(int argc, char** argv) {
         goto usage;
     }
 
+    if(outname && (argc - i) > 1) {
+        printf("Error: Only one file may be given with -o\n");
+        goto error;
+    }
     if(recordsize > recordsize_max || recordsize > LONG_MAX) {
         printf("Error: Record size is too large\n");
         goto error;
@@ -192,10 +351,17 @@ int main(int argc, char** argv) {
     }
 
     //
-    // Process files
+    // Process files, reading the next few ahead
     //
-    for(; i < argc; i++) {
-        if(byteswap(argv[i], buf, buffersize, (size_t)recordsize, quiet)) {
+    for(j = i; i < argc; i++) {
+        if(depth > 1) {
+            for(; j < argc && ((unsigned long)(j - i)) < depth; j++) {
+                byteswap_prefetch(argv[j]);
+            }
+        }
+        if(byteswap(
+            argv[i], outname, buf, buffersize, (size_t)recordsize, quiet
+        )) {
             returncode = 1;
         }
     }
@@ -205,9 +371,14 @@ usage:
     banner();
     printf("Swaps the byte order of each record in a file, in place.\n");
     printf("\n");
-    printf("Usage: %s [-q] [-s recordsize] files...\n", argv[0]);
+    printf("Usage: %s [-q] [-s recordsize] [-j n] files...\n", argv[0]);
+    printf("       %s [-q] [-s recordsize] -o outfile infile\n", argv[0]);
     printf(" -q: Quiet\n");
     printf(" -s: Size, in bytes, of each record to swap (default: 2)\n");
+    printf(" -o: Write to outfile instead of swapping in place\n");
+    printf(" -j: Have the OS read ahead, up to n files including the current one\n");
+    printf("     (default: 1)\n");
+    printf("Use - for stdin or stdout; swapping stdin writes to stdout.\n");
     goto error;
 
 error:
@@ -41,6 +41,7 @@ struct cdpatch_options {
     int8_t overwrite;
     int8_t verbose;
     int8_t recurse;
+    const char* journalname;
     const char** files;
     int files_count;
 };
@@ -57,8 +58,42 @@ static int exists(const char* filename) {
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static int pathsep(char c) { return c == '/' || c == '\\'; }
+static int pathend(char c) { return c == 0 || pathsep(c); }
+
+////////////////////////////////////////////////////////////////////////////////
+
 static const char* oom = "Error: Out of memory\n";
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Read one line into a growable buffer
+// Returns 0 on success, -1 on end-of-file, or 1 on error
+//
+static int readline(FILE* f, char** line, size_t* linesize) {
+    size_t len = 0;
+    int c;
+    for(;;) {
+        if(len + 1 >= *linesize) {
+            size_t newsize = (*linesize) ? 2 * (*linesize) : 256;
+            char* newline = realloc(*line, newsize);
+            if(!newline) {
+                printf("%s", oom);
+                return 1;
+            }
+            *line = newline;
+            *linesize = newsize;
+        }
+        c = fgetc(f);
+        if(c == EOF && !len) { return -1; }
+        if(c == EOF || c == '\n') { break; }
+        (*line)[len++] = (char)c;
+    }
+    if(len && (*line)[len - 1] == '\r') { len--; }
+    (*line)[len] = 0;
+    return 0;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 static uint32_t get32lsb(const uint8_t* p) {
@@ -136,12 +171,15 @@ static void eccedc_init(void) {
 //
 // Compute EDC for a block
 //
-static void edc_computeblock(const uint8_t* src, size_t size, uint8_t* dest) {
-    uint32_t edc = 0;
+static uint32_t edc_update(uint32_t edc, const uint8_t* src, size_t size) {
     while(size--) {
         edc = (edc >> 8) ^ edc_lut[(edc ^ (*src++)) & 0xFF];
     }
-    set32lsb(dest, edc);
+    return edc;
+}
+
+static void edc_computeblock(const uint8_t* src, size_t size, uint8_t* dest) {
+    set32lsb(dest, edc_update(0, src, size));
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -343,17 +381,28 @@ enum {
     BINTYPE_2352    = 2
 };
 
+struct journal;
+
 struct binfile {
     FILE* f;
     const char* name;
     int type;
+    //
+    // Location of the data track: the first sector is at LBA 'lba' and at byte
+    // 'offset' in the file, and there are 'sectors' of them
+    //
+    uint32_t lba;
+    off_t offset;
     uint32_t sectors;
     struct cacheentry cache[CACHE_ENTRIES];
+    struct journal* journal;
+    char* namebuf; // if the name was resolved from a cue sheet
 };
 
 static void bin_quit(struct binfile* bin) {
     size_t i;
     if(bin->f) { fclose(bin->f); }
+    if(bin->namebuf) { free(bin->namebuf); }
     for(i = 0; i < CACHE_ENTRIES; i++) {
         if(bin->cache[i].data) { free(bin->cache[i].data); }
     }
@@ -480,19 +529,338 @@ done:
     return (bin->type == BINTYPE_UNKNOWN);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Cue sheet support
+//
+// Finds the first data track described by a cue sheet and opens the file it
+// lives in.  The track doesn't need to start at the beginning of the file, or
+// be the only track in it; sector numbers are counted from the start of the
+// disc, same as the ISO9660 metadata does.
+//
+static int iscuesheet(const char* name) {
+    size_t len = strlen(name);
+    return
+        (len >= 4) &&
+        (name[len - 4] == '.') &&
+        (tolower((unsigned char)(name[len - 3])) == 'c') &&
+        (tolower((unsigned char)(name[len - 2])) == 'u') &&
+        (tolower((unsigned char)(name[len - 1])) == 'e');
+}
+
+static int cue_keyword(const char* a, const char* b) {
+    if(!a) { return 0; }
+    for(;;) {
+        int ca = tolower((unsigned char)(*a++));
+        int cb = tolower((unsigned char)(*b++));
+        if(ca != cb) { return 0; }
+        if(!ca) { return 1; }
+    }
+}
+
+//
+// Get the next whitespace-delimited or quoted token, or NULL if there are none
+//
+static char* cue_token(char** p) {
+    char* s = *p;
+    char* t;
+    while(isspace((unsigned char)(*s))) { s++; }
+    if(!(*s)) { *p = s; return NULL; }
+    if(*s == '"') {
+        t = ++s;
+        while(*s && *s != '"') { s++; }
+    } else {
+        t = s;
+        while(*s && !isspace((unsigned char)(*s))) { s++; }
+    }
+    if(*s) { *s++ = 0; }
+    *p = s;
+    return t;
+}
+
+//
+// Parse mm:ss:ff into a frame count
+// Returns nonzero on error
+//
+static int cue_msf(const char* s, uint32_t* frames) {
+    char* end;
+    uint32_t m, sec, f;
+    if(!s) { return 1; }
+    m   = strtoul(s, &end, 10); if(end == s || *end != ':') { return 1; }
+    s   = end + 1;
+    sec = strtoul(s, &end, 10); if(end == s || *end != ':') { return 1; }
+    s   = end + 1;
+    f   = strtoul(s, &end, 10); if(end == s || *end        ) { return 1; }
+    if(sec >= 60 || f >= 75) { return 1; }
+    *frames = (m * 60 + sec) * 75 + f;
+    return 0;
+}
+
+static const struct {
+    const char* name;
+    uint16_t sectorsize;
+    int8_t isdata;
+    int8_t type;
+} cue_modes[] = {
+    { "AUDIO"     , 2352, 0, BINTYPE_UNKNOWN },
+    { "CDG"       , 2448, 0, BINTYPE_UNKNOWN },
+    { "MODE1/2048", 2048, 1, BINTYPE_2048    },
+    { "MODE1/2352", 2352, 1, BINTYPE_2352    },
+    { "MODE2/2336", 2336, 1, BINTYPE_UNKNOWN },
+    { "MODE2/2352", 2352, 1, BINTYPE_2352    },
+    { "CDI/2336"  , 2336, 1, BINTYPE_UNKNOWN },
+    { "CDI/2352"  , 2352, 1, BINTYPE_UNKNOWN }
+};
+
+//
+// Files named in a cue sheet are relative to the cue sheet's directory
+// Returns NULL on failure
+//
+static char* cue_resolve(const char* cuename, const char* name) {
+    size_t dirlen = 0;
+    size_t i;
+    char* path;
+    if(!pathsep(name[0]) && !(name[0] && name[1] == ':')) {
+        for(i = 0; cuename[i]; i++) {
+            if(pathsep(cuename[i])) { dirlen = i + 1; }
+        }
+    }
+    path = malloc(dirlen + strlen(name) + 1);
+    if(!path) {
+        printf("%s", oom);
+        return NULL;
+    }
+    memmove(path, cuename, dirlen);
+    strcpy(path + dirlen, name);
+    return path;
+}
+
+//
+// Returns nonzero on error
+//
+static int cue_filesectors(const char* name, uint32_t sectorsize, uint32_t* n) {
+    struct stat st;
+    if(stat(name, &st) != 0) {
+        printfileerror(NULL, name);
+        return 1;
+    }
+    *n = (uint32_t)(((off_t)(st.st_size)) / ((off_t)sectorsize));
+    return 0;
+}
+
+//
+// Open the data track of a cue sheet, filling in the binfile location info
+// Returns nonzero on error
+//
+static int cue_open(struct binfile* bin, const char* mode) {
+    int returncode = 0;
+    const char* cuename = bin->name;
+    FILE* cue = NULL;
+    char* line = NULL;
+    size_t linesize = 0;
+    char* curfile = NULL;       // current FILE
+    int curbinary = 0;          // whether it's BINARY
+    int newfile = 0;            // no TRACK seen yet in this FILE
+    uint32_t filelba = 0;       // LBA where the current FILE starts
+    uint32_t filesectorsize = 2352;
+    uint32_t pregap = 0;        // total PREGAP not present in any FILE
+    uint32_t origin = 0;        // where track 1's INDEX 01 is: LBA 0
+    int haveorigin = 0;
+    uint32_t tracksectorsize = 0;
+    int tracktype = BINTYPE_UNKNOWN;
+    int trackdata = 0;
+    int found = 0;
+    int pendingend = 0;
+    int ended = 0;
+    uint32_t start = 0;
+    uint32_t end = 0;
+    uint32_t linenum = 0;
+    int r;
+
+    cue = fopen(cuename, "rb");
+    if(!cue) { goto error_cue; }
+
+    for(;;) {
+        char* p;
+        char* cmd;
+        r = readline(cue, &line, &linesize);
+        if(r > 0) { goto error; }
+        if(r < 0) { break; }
+        linenum++;
+        p = line;
+        cmd = cue_token(&p);
+        if(!cmd) { continue; }
+
+        if(cue_keyword(cmd, "FILE")) {
+            char* name = cue_token(&p);
+            char* type = cue_token(&p);
+            if(!name || !type) { goto error_syntax; }
+            //
+            // The data track ends at the end of its file
+            //
+            if(found) { break; }
+            if(curfile) {
+                uint32_t n;
+                if(cue_filesectors(curfile, filesectorsize, &n)) { goto error; }
+                filelba += n;
+                free(curfile);
+            }
+            curfile = cue_resolve(cuename, name);
+            if(!curfile) { goto error; }
+            curbinary = cue_keyword(type, "BINARY");
+            newfile = 1;
+
+        } else if(cue_keyword(cmd, "TRACK")) {
+            char* number = cue_token(&p);
+            char* m = cue_token(&p);
+            size_t i;
+            if(!number || !m || !(curfile || found)) { goto error_syntax; }
+            for(i = 0; i < sizeof(cue_modes) / sizeof(cue_modes[0]); i++) {
+                if(cue_keyword(m, cue_modes[i].name)) { break; }
+            }
+            if(i >= sizeof(cue_modes) / sizeof(cue_modes[0])) {
+                printf("Error: %s: Unknown track mode %s\n", cuename, m);
+                goto error;
+            }
+            if(newfile) {
+                filesectorsize = cue_modes[i].sectorsize;
+                newfile = 0;
+            }
+            if(found) {
+                //
+                // The data track ends where this track's first index begins
+                //
+                pendingend = 1;
+            } else {
+                trackdata       = cue_modes[i].isdata;
+                tracktype       = cue_modes[i].type;
+                tracksectorsize = cue_modes[i].sectorsize;
+                if(trackdata && tracktype == BINTYPE_UNKNOWN) {
+                    printf("Error: %s: Track %s: %s tracks are not supported\n",
+                        cuename, number, cue_modes[i].name
+                    );
+                    goto error;
+                }
+                if(trackdata && !curbinary) {
+                    printf("Error: %s: Track %s: Data track must be BINARY\n",
+                        cuename, number
+                    );
+                    goto error;
+                }
+            }
+
+        } else if(cue_keyword(cmd, "PREGAP")) {
+            uint32_t frames;
+            if(cue_msf(cue_token(&p), &frames)) { goto error_syntax; }
+            if(!found) { pregap += frames; }
+
+        } else if(cue_keyword(cmd, "INDEX")) {
+            char* number = cue_token(&p);
+            uint32_t frames;
+            if(!number || cue_msf(cue_token(&p), &frames)) {
+                goto error_syntax;
+            }
+            if(pendingend) {
+                end = frames;
+                ended = 1;
+                break;
+            }
+            //
+            // LBAs count from the first track's INDEX 01, so any pregap or
+            // INDEX 00 before it doesn't count, even if it's in the file
+            //
+            if(!haveorigin && strtoul(number, NULL, 10) == 1) {
+                origin = filelba + pregap + frames;
+                haveorigin = 1;
+            }
+            if(!found && trackdata && strtoul(number, NULL, 10) == 1) {
+                found = 1;
+                start = frames;
+                bin->lba = filelba + pregap + frames - origin;
+                bin->type = tracktype;
+                bin->namebuf = curfile;
+                curfile = NULL;
+            }
+        }
+    }
+
+    if(!found) {
+        printf("Error: %s: No data track found\n", cuename);
+        goto error;
+    }
+
+    bin->name = bin->namebuf;
+    bin->f = fopen(bin->name, mode);
+    if(!bin->f) { goto error_bin; }
+
+    if(!ended) {
+        off_t size;
+        if(fseeko(bin->f, 0, SEEK_END) != 0) { goto error_bin; }
+        size = ftello(bin->f);
+        if(size == -1) { goto error_bin; }
+        size /= (off_t)tracksectorsize;
+        end = (sizeof(off_t) > 4 && ((size >> 31) > 1)) ?
+            ((uint32_t)(0xFFFFFFFFLU)) : ((uint32_t)size);
+    }
+    if(end < start) {
+        printf("Error: %s: Data track has negative length\n", cuename);
+        goto error;
+    }
+    bin->offset = ((off_t)tracksectorsize) * ((off_t)start);
+    bin->sectors = end - start;
+
+    goto done;
+
+error_syntax:
+    printf("Error: %s: Syntax error on line %lu\n",
+        cuename, (unsigned long)linenum
+    );
+    goto error;
+error_cue:
+    printfileerror(cue, cuename);
+    goto error;
+error_bin:
+    printfileerror(bin->f, bin->name);
+    goto error;
+error:
+    bin->type = BINTYPE_UNKNOWN;
+    returncode = 1;
+    goto done;
+done:
+    if(curfile) { free(curfile); }
+    if(line) { free(line); }
+    if(cue) { fclose(cue); }
+    return returncode;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Ensure that the sector number is within the seekable range for the bin file;
 // returns nonzero on error
 //
 int check_bin_sector_range(const struct binfile* bin, uint32_t sector) {
-    if(sector >= bin->sectors) {
+    if(sector < bin->lba || (sector - bin->lba) >= bin->sectors) {
         printf("Error: Sector %lu is out of range\n", (unsigned long)sector);
         return 1;
     }
     return 0;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Seek to the given offset within a sector (which must be in range)
+// Returns nonzero on error
+//
+static int bin_seek(struct binfile* bin, uint32_t sector, uint32_t offset) {
+    off_t sectorsize = (bin->type == BINTYPE_2048) ? 2048 : 2352;
+    return fseeko(bin->f,
+        bin->offset +
+        sectorsize * ((off_t)(sector - bin->lba)) +
+        ((off_t)offset),
+        SEEK_SET
+    );
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Returns NULL on failure
@@ -511,9 +879,7 @@ static uint8_t* read_raw_sector(struct binfile* bin, uint32_t sector) {
     data = cache_find(bin, sector);
     if(!data) {
         data = cache_allocbegin(bin, sector);
-        if(fseeko(bin->f, 2352 * ((off_t)sector), SEEK_SET) != 0) {
-            goto error_f;
-        }
+        if(bin_seek(bin, sector, 0) != 0) { goto error_f; }
         if(fread(data, 1, 2352, bin->f) != 2352) { goto error_f; }
         cache_allocend(bin);
     }
@@ -544,15 +910,10 @@ static uint8_t* read_cooked_sector(
     data = cache_find(bin, sector);
     if(!data) {
         data = cache_allocbegin(bin, sector);
+        if(bin_seek(bin, sector, 0) != 0) { goto error_f; }
         if(bin->type == BINTYPE_2048) {
-            if(fseeko(bin->f, 2048 * ((off_t)sector), SEEK_SET) != 0) {
-                goto error_f;
-            }
             if(fread(data, 1, 2048, bin->f) != 2048) { goto error_f; }
         } else {
-            if(fseeko(bin->f, 2352 * ((off_t)sector), SEEK_SET) != 0) {
-                goto error_f;
-            }
             if(fread(data, 1, 2352, bin->f) != 2352) { goto error_f; }
             //
             // Verify the EDC
@@ -663,7 +1024,7 @@ static int writeback_raw_sector(struct binfile* bin, uint32_t sector) {
     //
     // Seek and write
     //
-    if(fseeko(bin->f, 2352 * ((off_t)sector), SEEK_SET) != 0) { goto error_f; }
+    if(bin_seek(bin, sector, 0) != 0) { goto error_f; }
     if(fwrite(data, 1, 2352, bin->f) != 2352) { goto error_f; }
     fflush(bin->f);
 
@@ -705,7 +1066,7 @@ static int writeback_cooked_sector(
         //
         // If this is an ISO file, just seek and write directly
         //
-        if(fseeko(bin->f, 2048 * ((off_t)sector), SEEK_SET) != 0) { goto error_f; }
+        if(bin_seek(bin, sector, 0) != 0) { goto error_f; }
         if(fwrite(data, 1, 2048, bin->f) != 2048) { goto error_f; }
 
     } else {
@@ -725,7 +1086,7 @@ static int writeback_cooked_sector(
         //
         // Seek and write
         //
-        if(fseeko(bin->f, 2352 * ((off_t)sector), SEEK_SET) != 0) { goto error_f; }
+        if(bin_seek(bin, sector, 0) != 0) { goto error_f; }
         if(fwrite(data, 1, 2352, bin->f) != 2352) { goto error_f; }
 
     }
@@ -770,9 +1131,7 @@ static int rw_cooked_data(
         //
         // Read or write the image file directly
         //
-        if(fseeko(
-            bin->f, 2048 * ((off_t)sector) + ((off_t)offset), SEEK_SET
-        ) != 0) { goto error_f; }
+        if(bin_seek(bin, sector, offset) != 0) { goto error_f; }
         if(write) {
             if(fwrite(data, 1, size, bin->f) != size) { goto error_f; }
         } else {
@@ -838,6 +1197,330 @@ static int write_cooked_data(
     return rw_cooked_data(bin, sector, offset, (uint8_t*)data, size, opt, 1);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Insert journal
+//
+// Remembers, for each file inserted into the image, where it went and an EDC
+// checksum of each sector's worth of input.  On later insert passes, sectors
+// whose input hasn't changed are left alone, which avoids rewriting the sector
+// and regenerating its ECC/EDC.
+//
+// The journal is only trusted if the image is still the same file, with the
+// same size and modification time, as when the journal was saved.
+//
+struct jentry {
+    struct jentry* next;
+    char* name;
+    uint32_t sector;
+    uint32_t size;
+    uint32_t count;
+    uint32_t* sectoredc; // NULL if unavailable
+};
+
+struct journal {
+    const char* name;
+    struct jentry* entries;
+};
+
+static const char* journal_magic = "cdpatch journal";
+
+static void jentry_free(struct jentry* e) {
+    if(e) {
+        if(e->name     ) { free(e->name     ); }
+        if(e->sectoredc) { free(e->sectoredc); }
+        free(e);
+    }
+}
+
+//
+// Returns NULL on failure
+//
+static struct jentry* jentry_new(const char* name, uint32_t sector) {
+    struct jentry* e = malloc(sizeof(struct jentry));
+    if(!e) { goto error_mem; }
+    memset(e, 0, sizeof(struct jentry));
+    e->name = malloc(strlen(name) + 1);
+    if(!e->name) { goto error_mem; }
+    strcpy(e->name, name);
+    e->sector = sector;
+    return e;
+
+error_mem:
+    printf("%s", oom);
+    jentry_free(e);
+    return NULL;
+}
+
+//
+// Allocate room for per-sector checksums
+// If there's too many to fit in memory, the entry just won't have them
+//
+static void jentry_alloc_sectors(struct jentry* e, uint32_t count) {
+    size_t bytes = ((size_t)count) * sizeof(uint32_t);
+    e->count = count;
+    if(count && (bytes / sizeof(uint32_t)) == count) {
+        e->sectoredc = malloc(bytes);
+    }
+}
+
+static void journal_quit(struct journal* j) {
+    while(j->entries) {
+        struct jentry* next = j->entries->next;
+        jentry_free(j->entries);
+        j->entries = next;
+    }
+}
+
+//
+// Remove and return the entry for the given name, or NULL if there is none
+//
+static struct jentry* journal_take(struct journal* j, const char* name) {
+    struct jentry** p;
+    for(p = &(j->entries); *p; p = &((*p)->next)) {
+        if(!strcmp((*p)->name, name)) {
+            struct jentry* e = *p;
+            *p = e->next;
+            e->next = NULL;
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void journal_add(struct journal* j, struct jentry* e) {
+    e->next = j->entries;
+    j->entries = e;
+}
+
+//
+// Decide whether a sector of input matches what the journal recorded, and
+// record the new checksum either way
+//
+// Returns nonzero if the sector doesn't need to be rewritten
+//
+static int journal_unchanged(
+    const struct jentry* old,
+    struct jentry* rec,
+    uint32_t index,
+    const uint8_t* data,
+    size_t size
+) {
+    uint32_t edc;
+    int last;
+    if(!rec) { return 0; }
+    edc = edc_update(0, data, size);
+    if(rec->sectoredc && index < rec->count) {
+        rec->sectoredc[index] = edc;
+    }
+    if(!old || !old->sectoredc || index >= old->count) { return 0; }
+    if(old->sectoredc[index] != edc) { return 0; }
+    //
+    // The last sector of a file is special (it's flagged as such and may be
+    // partial), so only skip it if it was also last, at the same size, before
+    //
+    last = (index + 1) == rec->count;
+    if(last != ((index + 1) == old->count)) { return 0; }
+    if(last && old->size != rec->size) { return 0; }
+    return 1;
+}
+
+//
+// The stamp identifies the image by device, inode, size, and modification
+// time, and records when the journal was saved.  A timestamp only has a
+// resolution of a second or two, so the image could still change without its
+// timestamp changing if it was modified too close to the save; such a stamp is
+// never trusted.
+//
+enum { JOURNAL_STAMP_SLACK = 2 };
+
+//
+// Write the stamp, which is checked on load
+// Waits, if need be, for the image's timestamp to be old enough to trust
+//
+static int journal_stamp(FILE* f, const char* imagename) {
+    struct stat st;
+    time_t now;
+    if(stat(imagename, &st) != 0) {
+        printfileerror(NULL, imagename);
+        return 1;
+    }
+    now = time(NULL);
+    if(st.st_mtime <= now + JOURNAL_STAMP_SLACK) {
+        while(now < st.st_mtime + JOURNAL_STAMP_SLACK) {
+            sleepseconds(1);
+            now = time(NULL);
+        }
+    }
+    fprintdec(f, (off_t)(st.st_size));
+    fprintf(f, " %lu %lu %lu %lu",
+        (unsigned long)(st.st_mtime),
+        (unsigned long)(st.st_dev),
+        (unsigned long)(st.st_ino),
+        (unsigned long)(now)
+    );
+    return 0;
+}
+
+static int journal_stamp_matches(const char* s, const char* imagename) {
+    struct stat st;
+    char* end;
+    unsigned long mtime, saved;
+    if(stat(imagename, &st) != 0) { return 0; }
+    if(strtoofft(s, &end, 10) != (off_t)(st.st_size)) { return 0; }
+    mtime = strtoul(end, &end, 10);
+    if(mtime != (unsigned long)(st.st_mtime)) { return 0; }
+    if(strtoul(end, &end, 10) != (unsigned long)(st.st_dev)) { return 0; }
+    if(strtoul(end, &end, 10) != (unsigned long)(st.st_ino)) { return 0; }
+    saved = strtoul(end, &end, 10);
+    if(*end) { return 0; }
+    if(mtime + JOURNAL_STAMP_SLACK > saved) { return 0; }
+    return 1;
+}
+
+//
+// Load the journal; a missing or out-of-date journal is treated as empty
+// Returns nonzero on error
+//
+static int journal_load(
+    struct journal* j,
+    const char* imagename,
+    const struct cdpatch_options* opt
+) {
+    int returncode = 0;
+    FILE* f = NULL;
+    char* line = NULL;
+    size_t linesize = 0;
+    size_t magiclen = strlen(journal_magic);
+    struct jentry* e = NULL;
+    uint32_t filled = 0;
+    int r;
+
+    f = fopen(j->name, "rb");
+    if(!f) { goto done; }
+
+    r = readline(f, &line, &linesize);
+    if(r > 0) { goto error; }
+    if(
+        r < 0 ||
+        strncmp(line, journal_magic, magiclen) ||
+        !journal_stamp_matches(line + magiclen, imagename)
+    ) {
+        if(opt->verbose) {
+            printf("Journal %s is out of date; ignoring\n", j->name);
+        }
+        goto done;
+    }
+
+    for(;;) {
+        r = readline(f, &line, &linesize);
+        if(r > 0) { goto error; }
+        if(r < 0) { break; }
+        if(line[0] == 'F' && line[1] == ' ') {
+            //
+            // F sector size count name
+            //
+            char* p = line + 2;
+            uint32_t sector, size, count;
+            sector = strtoul(p, &p, 10);
+            size   = strtoul(p, &p, 10);
+            count  = strtoul(p, &p, 10);
+            if(*p++ != ' ') { goto error_format; }
+            if(e) {
+                if(filled < e->count) { free(e->sectoredc); e->sectoredc = NULL; }
+                journal_add(j, e);
+            }
+            e = jentry_new(p, sector);
+            if(!e) { goto error; }
+            e->size = size;
+            jentry_alloc_sectors(e, count);
+            filled = 0;
+        } else if(line[0] == 'S' && line[1] == ' ') {
+            //
+            // S edc edc edc...
+            //
+            char* p = line + 1;
+            if(!e) { goto error_format; }
+            while(*p) {
+                char* end;
+                uint32_t edc = strtoul(p, &end, 16);
+                if(end == p) { goto error_format; }
+                p = end;
+                if(filled >= e->count) { goto error_format; }
+                if(e->sectoredc) { e->sectoredc[filled] = edc; }
+                filled++;
+            }
+        } else if(line[0]) {
+            goto error_format;
+        }
+    }
+    if(e) {
+        if(filled < e->count) { free(e->sectoredc); e->sectoredc = NULL; }
+        journal_add(j, e);
+        e = NULL;
+    }
+    goto done;
+
+error_format:
+    printf("Error: %s: Journal is malformed\n", j->name);
+    goto error;
+error:
+    returncode = 1;
+    goto done;
+done:
+    jentry_free(e);
+    if(line) { free(line); }
+    if(f) { fclose(f); }
+    return returncode;
+}
+
+//
+// Save the journal; must be called after the image is closed
+// Returns nonzero on error
+//
+static int journal_save(struct journal* j, const char* imagename) {
+    FILE* f = NULL;
+    const struct jentry* e;
+    uint32_t i;
+
+    f = fopen(j->name, "wb");
+    if(!f) { goto error_f; }
+
+    fprintf(f, "%s ", journal_magic);
+    if(journal_stamp(f, imagename)) { goto error; }
+    fputc('\n', f);
+
+    for(e = j->entries; e; e = e->next) {
+        fprintf(f, "F %lu %lu %lu %s\n",
+            (unsigned long)(e->sector),
+            (unsigned long)(e->size),
+            (unsigned long)(e->sectoredc ? e->count : 0),
+            e->name
+        );
+        if(!e->sectoredc) { continue; }
+        for(i = 0; i < e->count; i++) {
+            fprintf(f, "%s%08lX", (i & 7) ? " " : "S ",
+                (unsigned long)(e->sectoredc[i])
+            );
+            if((i & 7) == 7 || (i + 1) == e->count) { fputc('\n', f); }
+        }
+    }
+    if(fflush(f) != 0 || ferror(f)) { goto error_f; }
+    fclose(f);
+    return 0;
+
+error_f:
+    printfileerror(f, j->name);
+    goto error;
+error:
+    //
+    // Don't leave a partial journal behind
+    //
+    if(f) { fclose(f); }
+    remove(j->name);
+    return 1;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Use RIFF if:
@@ -966,18 +1649,29 @@ done:
 // Returns nonzero on error
 // Outputs the new size in *filesize
 //
+// If rec is given, it's filled in with the journal record for the new contents,
+// and any sector that matches the old record is skipped.
+//
 static int insert_file(
     struct binfile* bin,
     uint32_t sector,
     uint32_t* filesize,
     const char* filename,
-    const struct cdpatch_options* opt
+    const struct cdpatch_options* opt,
+    const struct jentry* old,
+    struct jentry* rec
 ) {
     int returncode = 0;
     uint8_t* data = NULL;
+    uint8_t* buf = NULL;
     FILE* f = NULL;
     uint32_t newfilesize;
     uint32_t sectors = sectorcount(*filesize);
+    uint32_t index;
+    uint32_t unchanged = 0;
+
+    buf = malloc(2352);
+    if(!buf) { goto error_mem; }
 
     f = fopen(filename, "rb");
     if(!f) { goto error_f; }
@@ -1064,20 +1758,28 @@ static int insert_file(
         //
         newfilesize -= 0x2C;
         *filesize = (newfilesize / 2352) * 2048;
-        for(; newfilesize >= 2352; sector++) {
+        if(rec) {
+            rec->size = *filesize;
+            jentry_alloc_sectors(rec, newfilesize / 2352);
+        }
+        for(index = 0; newfilesize >= 2352; sector++, index++) {
+            if(fread(buf, 1, 2352, f) != 2352) { goto error_f; }
+            newfilesize -= 2352;
+            if(journal_unchanged(old, rec, index, buf, 2352)) {
+                unchanged++;
+                continue;
+            }
+
             data = read_raw_sector(bin, sector);
             if(!data) { goto error; }
 
-            // Ignore sync and address
-            if(fread(data + 0x00F, 1, 0x00F, f) != 0x00F) { goto error_f; }
-            // Read mode and everything else
-            if(fread(data + 0x00F, 1, 0x921, f) != 0x921) { goto error_f; }
+            // Ignore sync and address; copy mode and everything else
+            memmove(data + 0x00F, buf + 0x00F, 0x921);
             // Regenerate sync and ECC/EDC
             memmove(data, sync_header, sizeof(sync_header));
             eccedc_generate(data);
 
             if(writeback_raw_sector(bin, sector)) { goto error; }
-            newfilesize -= 2352;
         }
 
     } else {
@@ -1105,24 +1807,45 @@ static int insert_file(
         // Insert normally
         //
         *filesize = newfilesize;
-        for(; newfilesize; sector++) {
+        if(rec) {
+            rec->size = newfilesize;
+            jentry_alloc_sectors(rec, sectorcount(newfilesize));
+        }
+        for(index = 0; newfilesize; sector++, index++) {
             size_t remain = newfilesize < 2048 ? newfilesize : 2048;
+            int last = newfilesize <= 2048;
+
+            if(fread(buf, 1, remain, f) != remain) { goto error_f; }
+            newfilesize -= remain;
+            if(journal_unchanged(old, rec, index, buf, remain)) {
+                unchanged++;
+                continue;
+            }
+            if(remain < 2048) { memset(buf + remain, 0, 2048 - remain); }
 
             data = alloc_cooked_sector(bin, sector, opt);
             if(!data) { goto error; }
+            memmove(data, buf, 2048);
 
-            if(fread(data, 1, remain, f) != remain) { goto error_f; }
-            if(remain < 2048) { memset(data + remain, 0, 2048 - remain); }
-
-            if(writeback_cooked_sector(bin, sector, 1, newfilesize <= 2048)) {
+            if(writeback_cooked_sector(bin, sector, 1, last)) {
                 goto error;
             }
-            newfilesize -= remain;
         }
     }
 
+    if(opt->verbose && unchanged) {
+        printf("       %lu of %lu sector%s unchanged\n",
+            (unsigned long)unchanged,
+            (unsigned long)index,
+            index != 1 ? "s" : ""
+        );
+    }
+
     goto done;
 
+error_mem:
+    printf("%s", oom);
+    goto error;
 error_f:
     printfileerror(f, filename);
     goto error;
@@ -1131,6 +1854,7 @@ error:
     goto done;
 done:
     if(f) { fclose(f); }
+    if(buf) { free(buf); }
     return returncode;
 }
 
@@ -1488,11 +2212,6 @@ done:
     return returncode;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-
-static int pathsep(char c) { return c == '/' || c == '\\'; }
-static int pathend(char c) { return c == 0 || pathsep(c); }
-
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Pass f=NULL to get the boot area
@@ -1509,6 +2228,8 @@ static void dofile(
     // Construct base filename from base name and node name
     //
     char* filename = NULL;
+    struct jentry* old = NULL;
+    struct jentry* rec = NULL;
     size_t basedirlen = strlen(opt->basedir);
     size_t addsep = !(basedirlen && pathsep(opt->basedir[basedirlen - 1]));
     size_t filenamelen = basedirlen + addsep +
@@ -1549,7 +2270,9 @@ static void dofile(
                 bin, filenode->sector, filenode->size, filename, opt
             )) { goto error; }
         } else {
-            if(extract_file(bin, 0, 32768, filename, opt)) { goto error; }
+            if(extract_file(bin, bin->lba, 32768, filename, opt)) {
+                goto error;
+            }
         }
         (*numsuccesses)++;
 
@@ -1559,7 +2282,22 @@ static void dofile(
         //
         if(filenode) {
             uint32_t newsize = filenode->size;
-            if(insert_file(bin, filenode->sector, &newsize, filename, opt)) {
+            if(bin->journal) {
+                //
+                // Journal entries are keyed by the path within the image
+                //
+                const char* isoname = filename + basedirlen + addsep;
+                old = journal_take(bin->journal, isoname);
+                if(old && old->sector != filenode->sector) {
+                    jentry_free(old);
+                    old = NULL;
+                }
+                rec = jentry_new(isoname, filenode->sector);
+                if(!rec) { goto error; }
+            }
+            if(insert_file(
+                bin, filenode->sector, &newsize, filename, opt, old, rec
+            )) {
                 goto error;
             }
             //
@@ -1578,9 +2316,15 @@ static void dofile(
                     opt
                 )) { goto error; }
             }
+            if(rec) {
+                journal_add(bin->journal, rec);
+                rec = NULL;
+            }
         } else {
             uint32_t newsize = 32768;
-            if(insert_file(bin, 0, &newsize, filename, opt)) {
+            if(insert_file(
+                bin, bin->lba, &newsize, filename, opt, NULL, NULL
+            )) {
                 goto error;
             }
         }
@@ -1596,6 +2340,8 @@ error:
     (*numerrors)++;
     goto done;
 done:
+    jentry_free(old);
+    jentry_free(rec);
     if(filename) { free(filename); }
 }
 
@@ -1822,24 +2568,36 @@ done:
 static int cdpatch(const struct cdpatch_options* opt) {
     int returncode = 0;
     struct binfile bin;
+    struct journal journal;
     struct node* root = NULL;
     int i;
     uint32_t numerrors    = 0;
     uint32_t numsuccesses = 0;
 
+    memset(&journal, 0, sizeof(journal));
+
     if(bin_init(&bin)) { goto error; }
     bin.name = opt->binname;
 
     //
-    // Attempt to open bin/iso file
+    // Attempt to open bin/iso file, or the data track named by a cue sheet
     //
-    bin.f = fopen(bin.name, opt->insert ? "r+b" : "rb");
-    if(!bin.f) { goto error_bin; }
+    if(iscuesheet(bin.name)) {
+        if(cue_open(&bin, opt->insert ? "r+b" : "rb")) { goto error; }
+    } else {
+        bin.f = fopen(bin.name, opt->insert ? "r+b" : "rb");
+        if(!bin.f) { goto error_bin; }
 
-    if(bintype_detect(&bin)) { goto error; }
+        if(bintype_detect(&bin)) { goto error; }
+    }
 
     if(opt->verbose) {
         printf("Image file: %s\n", opt->binname);
+        if(bin.namebuf) {
+            printf("Data track: %s at LBA %lu\n",
+                bin.name, (unsigned long)(bin.lba)
+            );
+        }
         printf("Format: ");
         switch(bin.type) {
         case BINTYPE_2048: printf("ISO (2048-byte sectors)\n"); break;
@@ -1847,10 +2605,19 @@ static int cdpatch(const struct cdpatch_options* opt) {
         }
     }
 
+    //
+    // Load the insert journal, if we're using one
+    //
+    if(opt->journalname) {
+        journal.name = opt->journalname;
+        if(journal_load(&journal, bin.name, opt)) { goto error; }
+        bin.journal = &journal;
+    }
+
     //
     // Read primary descriptor
     //
-    {   uint8_t* data = read_cooked_sector(&bin, 16, opt);
+    {   uint8_t* data = read_cooked_sector(&bin, bin.lba + 16, opt);
         if(!data) { goto error; }
         if(opt->verbose) {
             printf("System ID: ");
@@ -1875,7 +2642,7 @@ static int cdpatch(const struct cdpatch_options* opt) {
     if(!root) { goto error_mem; }
     root->depth = 0;
     root->up = NULL;
-    i = read_iso_dr(&bin, root, 16, PD_root_dir_record, 2048, opt);
+    i = read_iso_dr(&bin, root, bin.lba + 16, PD_root_dir_record, 2048, opt);
     if(i < 0) { goto error; }
     if(i == 0) {
         printf("Error: Root directory descriptor is missing\n");
@@ -1920,6 +2687,17 @@ error:
     goto done;
 done:
     if(root) { free(root); }
+    //
+    // Save the journal once the image is closed
+    //
+    if(bin.f) {
+        fclose(bin.f);
+        bin.f = NULL;
+    }
+    if(bin.journal && journal_save(&journal, bin.name)) {
+        returncode = 1;
+    }
+    journal_quit(&journal);
     bin_quit(&bin);
     return returncode;
 }
@@ -1988,6 +2766,12 @@ int main(int argc, char** argv) {
                 if(argv[i+1][0] == '-') { warn_missing = argv[i]; }
                 opt.basedir = argv[++i];
                 continue;
+            } else if(!strcmp(argv[i], "-j")) {
+                if(opt.journalname) { goto error_dup; }
+                if(i >= (argc - 1)) { goto error_missing; }
+                if(argv[i+1][0] == '-') { warn_missing = argv[i]; }
+                opt.journalname = argv[++i];
+                continue;
             } else if(!strcmp(argv[i], "-be")) {
                 opt.big = 1;
                 continue;
@@ -2023,6 +2807,9 @@ int main(int argc, char** argv) {
     if(checkboth  (opt.big   , opt.little   ,"-be","-le")) { goto error_usage; }
     if(checkboth  (opt.insert, opt.extract  ,"-i","-x")) { goto error_usage; }
     if(checkboth  (opt.insert, opt.overwrite,"-i","-o")) { goto error_usage; }
+    if(checkboth  (opt.extract, opt.journalname != NULL,"-x","-j")) {
+        goto error_usage;
+    }
 
     //
     // If base directory wasn't specified, default to "."
@@ -2069,14 +2856,15 @@ usage:
     banner();
     printf(
         "Usage:\n"
-        "  To insert:  %s -i bin_or_iso [options] [files...]\n"
-        "  To extract: %s -x bin_or_iso [options] [files...]\n"
+        "  To insert:  %s -i bin_iso_or_cue [options] [files...]\n"
+        "  To extract: %s -x bin_iso_or_cue [options] [files...]\n"
         "\nOptions:\n"
         "  -be       Favor big-endian values in ISO9660 metadata\n"
         "  -boot     Insert or extract boot area\n"
         "  -d dir    Set the base directory for inserted or extracted files\n"
         "            (defaults to .)\n"
         "  -f        Skip filesystem consistency checks\n"
+        "  -j file   Use a journal to skip unchanged sectors when inserting\n"
         "  -le       Favor little-endian values in ISO9660 metadata\n"
         "  -o        Force overwrite when extracting files\n"
         "  -r        Recurse into subdirectories\n"
@@ -60,10 +60,21 @@ int _dowildcard = -1;
 #include <direct.h>
 #endif
 
-// Fill in S_ISDIR
+// Fill in S_ISDIR and S_ISREG
 #if !defined(_POSIX_VERSION) && !defined(S_ISDIR)
 #define S_ISDIR(m) (((m) & S_IFMT) == S_IFDIR)
 #endif
+#if !defined(_POSIX_VERSION) && !defined(S_ISREG)
+#define S_ISREG(m) (((m) & S_IFMT) == S_IFREG)
+#endif
+
+// Systems without symbolic links have no lstat()
+#if !defined(_POSIX_VERSION)
+#define lstat(a, b) stat(a, b)
+#endif
+#if !defined(S_ISLNK)
+#define S_ISLNK(m) 0
+#endif
 
 #if defined(__TURBOC__) || defined(__WATCOMC__) || defined(__MINGW32__) || defined(_MSC_VER)
 //
@@ -550,6 +561,190 @@ void printfileerror(FILE* f, const char* name) {
     printf("%s\n", f && feof(f) ? "Unexpected end-of-file" : strerror(errno));
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Ask the OS to start reading the first size bytes of a file in the background
+// Does nothing on systems that don't support it
+//
+#if defined(_POSIX_VERSION)
+#include <fcntl.h>
+#endif
+
+void prefetchfile(const char* filename, off_t size) {
+#if defined(POSIX_FADV_WILLNEED)
+    int fd = open(filename, O_RDONLY);
+    if(fd >= 0) {
+        posix_fadvise(fd, 0, size, POSIX_FADV_WILLNEED);
+        close(fd);
+    }
+#else
+    (void)filename;
+    (void)size;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Put stdin or stdout into binary mode, on systems that distinguish
+//
+#if defined(_WIN32) || defined(__MSDOS__) || defined(MSDOS)
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+void setbinarymode(FILE* f) {
+#if defined(_WIN32) || defined(__MSDOS__) || defined(MSDOS)
+    setmode(fileno(f), O_BINARY);
+#else
+    (void)f;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Create a new file for reading and writing, failing with errno = EEXIST if
+// there's already one by that name
+//
+// Where there's no way to do this atomically, it's checked beforehand
+//
+FILE* fopennew(const char* filename) {
+#if defined(_POSIX_VERSION)
+    FILE* f;
+    int fd = open(filename, O_RDWR | O_CREAT | O_EXCL, 0666);
+    if(fd < 0) { return NULL; }
+    f = fdopen(fd, "w+b");
+    if(!f) { close(fd); }
+    return f;
+#else
+    FILE* f = fopen(filename, "rb");
+    if(f) {
+        fclose(f);
+        errno = EEXIST;
+        return NULL;
+    }
+    return fopen(filename, "w+b");
+#endif
+}
+
+//
+// Give a file the same permission bits as another
+// Does nothing on systems that don't have them
+//
+void copyfilemode(const char* from, const char* to) {
+#if defined(_POSIX_VERSION)
+    struct stat st;
+    if(stat(from, &st) == 0) {
+        chmod(to, st.st_mode & 07777);
+    }
+#else
+    (void)from;
+    (void)to;
+#endif
+}
+
+//
+// Returns nonzero if two names refer to the same file
+// Without inode numbers, this can only compare the names
+//
+int samefile(const char* a, const char* b) {
+#if defined(_POSIX_VERSION)
+    struct stat sa;
+    struct stat sb;
+    if(stat(a, &sa) == 0 && stat(b, &sb) == 0) {
+        return sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+    }
+#endif
+    return !strcmp(a, b);
+}
+
+//
+// Wait for a number of seconds
+//
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__TURBOC__) || defined(__WATCOMC__)
+#include <dos.h>
+#endif
+
+void sleepseconds(unsigned seconds) {
+#if defined(_WIN32)
+    Sleep(seconds * 1000);
+#elif defined(_POSIX_VERSION) || defined(__TURBOC__) || defined(__WATCOMC__)
+    sleep(seconds);
+#else
+    time_t end = time(NULL) + seconds;
+    while(time(NULL) < end) { }
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Call a function for each entry in a directory, other than "." and ".."
+// Returns 0 on success, or -1 with errno set if the directory can't be read
+// If the function returns nonzero, that stops the loop and is returned instead
+//
+#if defined(_WIN32) && defined(_MSC_VER)
+#include <windows.h>
+#elif defined(__TURBOC__)
+#include <dir.h>
+#include <dos.h>
+#else
+#include <dirent.h>
+#endif
+
+static int isdotname(const char* name) {
+    return name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]));
+}
+
+int foreachdirentry(
+    const char* dirname,
+    int (*callback)(void* context, const char* name),
+    void* context
+) {
+#if defined(_WIN32) && defined(_MSC_VER)
+    WIN32_FIND_DATAA fd;
+    HANDLE h;
+    char* pattern = malloc(strlen(dirname) + 3);
+    int r = 0;
+    if(!pattern) { errno = ENOMEM; return -1; }
+    strcpy(pattern, dirname);
+    strcat(pattern, "\\*");
+    h = FindFirstFileA(pattern, &fd);
+    free(pattern);
+    if(h == INVALID_HANDLE_VALUE) { errno = ENOENT; return -1; }
+    do {
+        if(!isdotname(fd.cFileName)) { r = callback(context, fd.cFileName); }
+    } while(!r && FindNextFileA(h, &fd));
+    FindClose(h);
+    return r;
+#elif defined(__TURBOC__)
+    struct ffblk ff;
+    char* pattern = malloc(strlen(dirname) + 5);
+    int done;
+    int r = 0;
+    if(!pattern) { errno = ENOMEM; return -1; }
+    strcpy(pattern, dirname);
+    strcat(pattern, "\\*.*");
+    done = findfirst(pattern, &ff, FA_DIREC | FA_HIDDEN | FA_SYSTEM);
+    free(pattern);
+    if(done) { errno = ENOENT; return -1; }
+    for(; !done && !r; done = findnext(&ff)) {
+        if(!isdotname(ff.ff_name)) { r = callback(context, ff.ff_name); }
+    }
+    return r;
+#else
+    struct dirent* de;
+    DIR* d = opendir(dirname);
+    int r = 0;
+    if(!d) { return -1; }
+    while(!r && (de = readdir(d)) != NULL) {
+        if(!isdotname(de->d_name)) { r = callback(context, de->d_name); }
+    }
+    closedir(d);
+    return r;
+#endif
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 #if defined(_WIN32)
@@ -22,62 +22,141 @@
 #include "banner.h"
 
 ////////////////////////////////////////////////////////////////////////////////
-
-static uint32_t crctable_f[256];
-static uint32_t crctable_r[256];
+//
+// Slice-by-8 CRC32
+//
+static uint32_t crctable[8][256];
 
 static void crc_init(void) {
     uint32_t i, j, k;
     for(i = 0; i < 256; i++) {
         j = i;
         for(k = 0; k < 8; k++) {
-            j = (j >> 1) ^ ((j & 1) ? 0x80000000 : 0x6DB88320);
+            j = (j >> 1) ^ ((j & 1) ? 0xEDB88320LU : 0);
         }
-        crctable_f[i] = j;
-        j = i << 24;
-        for(k = 0; k < 8; k++) {
-            j = (j << 1) ^ ((((int32_t)j) < 0) ? 0x00000001 : 0xDB710640);
+        crctable[0][i] = j;
+    }
+    for(i = 0; i < 256; i++) {
+        for(k = 1; k < 8; k++) {
+            j = crctable[k - 1][i];
+            crctable[k][i] = (j >> 8) ^ crctable[0][j & 0xFF];
         }
-        crctable_r[i] = j;
     }
 }
 
-static uint32_t crc_nextbyte(uint32_t crc, uint8_t byte) {
-    return (crc >> 8) ^ crctable_f[(crc ^ byte) & 0xFF];
+static uint32_t crc_update(uint32_t crc, const uint8_t* p, size_t n) {
+    crc = ~crc;
+    for(; n >= 8; p += 8, n -= 8) {
+        uint32_t lo = crc ^ (
+            (((uint32_t)(p[0])) <<  0) |
+            (((uint32_t)(p[1])) <<  8) |
+            (((uint32_t)(p[2])) << 16) |
+            (((uint32_t)(p[3])) << 24)
+        );
+        crc =
+            crctable[7][(lo >>  0) & 0xFF] ^
+            crctable[6][(lo >>  8) & 0xFF] ^
+            crctable[5][(lo >> 16) & 0xFF] ^
+            crctable[4][(lo >> 24)       ] ^
+            crctable[3][p[4]] ^
+            crctable[2][p[5]] ^
+            crctable[1][p[6]] ^
+            crctable[0][p[7]];
+    }
+    for(; n; p++, n--) {
+        crc = (crc >> 8) ^ crctable[0][(crc ^ *p) & 0xFF];
+    }
+    return ~crc;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Undo the effect of appending zero bytes to a CRC register
+//
+// A CRC is linear, so flipping bits in the file flips bits in its CRC by the
+// same amount no matter what the rest of the file contains.  The change made
+// by 4 bytes at some offset is found by running the change in CRC backwards
+// over every byte from there to the end of the file.  That's done with a 32x32
+// matrix over GF(2), squared repeatedly, so it takes O(log n) time.
+//
+static uint32_t gf2_matrix_times(const uint32_t* mat, uint32_t vec) {
+    uint32_t sum = 0;
+    for(; vec; vec >>= 1, mat++) {
+        if(vec & 1) { sum ^= *mat; }
+    }
+    return sum;
+}
+
+static void gf2_matrix_square(uint32_t* square, const uint32_t* mat) {
+    unsigned n;
+    for(n = 0; n < 32; n++) {
+        square[n] = gf2_matrix_times(mat, mat[n]);
+    }
 }
 
-static uint32_t crc_prevbyte(uint32_t crc, uint8_t byte) {
-    return (crc << 8) ^ byte ^ crctable_r[crc >> 24];
+static uint32_t crc_unshift(uint32_t crc, off_t len) {
+    uint32_t odd[32];
+    uint32_t even[32];
+    uint32_t* op = odd;
+    unsigned n;
+    //
+    // Operator to back up one zero bit: the top bit can only have come from
+    // the polynomial, which means the low bit was shifted out
+    //
+    for(n = 0; n < 31; n++) {
+        odd[n] = ((uint32_t)1) << (n + 1);
+    }
+    odd[31] = (((0x80000000LU ^ 0xEDB88320LU) << 1) | 1) & 0xFFFFFFFFLU;
+    //
+    // Back up one zero byte
+    //
+    gf2_matrix_square(even, odd );
+    gf2_matrix_square(odd , even);
+    gf2_matrix_square(even, odd );
+    op = even;
+    while(len) {
+        uint32_t* other = (op == even) ? odd : even;
+        if(len & 1) { crc = gf2_matrix_times(op, crc); }
+        len >>= 1;
+        if(!len) { break; }
+        gf2_matrix_square(other, op);
+        op = other;
+    }
+    return crc;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Compute CRC forward for a section of a file
 //
-static uint8_t crc_buffer[4096];
+static uint8_t crc_buffer[0x8000];
 
 // Returns nonzero on error
-static int crc_f(uint32_t crc, FILE* f, off_t start, off_t end, uint32_t* result) {
+static int crc_f(
+    uint32_t    crc,
+    FILE*       f,
+    const char* name,
+    off_t       start,
+    off_t       end,
+    uint32_t*   result
+) {
     if(start < 0) { printf("error - start is negative\n"); return 1; }
     if(end   < 0) { printf("error - end is negative\n"); return 1; }
     if(start > end) { printf("error - start > end\n"); return 1; }
 
     if(fseeko(f, start, SEEK_SET) != 0) {
-        printf("seek error\n");
+        printfileerror(f, name);
         return 1;
     }
     while(start < end) {
-        off_t i;
         off_t diff = end - start;
         if(diff > ((off_t)sizeof(crc_buffer))) { diff = sizeof(crc_buffer); }
 
         if(fread(crc_buffer, 1, (size_t)diff, f) != (size_t)diff) {
-            printf("read error\n");
+            printfileerror(f, name);
             return 1;
         }
-        for(i = 0; i < diff; i++) {
-            crc = crc_nextbyte(crc, crc_buffer[i]);
-        }
+        crc = crc_update(crc, crc_buffer, (size_t)diff);
 
         start += diff;
     }
@@ -85,61 +164,291 @@ static int crc_f(uint32_t crc, FILE* f, off_t start, off_t end, uint32_t* result
     return 0;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Patch 4 bytes of a file to force its CRC
 //
-// Compute CRC reverse for a section of a file
+// If *patch_offset is negative, the last 4 bytes are used.  Everything is
+// checked before anything is written, and the write is a single 4-byte fwrite,
+// so a file is either patched completely or left alone.
 //
 // Returns nonzero on error
-static int crc_r(uint32_t crc, FILE* f, off_t start, off_t end, uint32_t* result) {
-    if(start < 0) { printf("error - start is negative\n"); return 1; }
-    if(end   < 0) { printf("error - end is negative\n"); return 1; }
-    if(start > end) { printf("error - start > end\n"); return 1; }
+//
+static int force_crc(
+    const char*     filename,
+    const uint32_t* known_crc,  // NULL if the file should be read
+    uint32_t        desired_crc,
+    off_t*          patch_offset,
+    uint8_t*        initial_bytes,
+    uint8_t*        patched_bytes
+) {
+    FILE* f = NULL;
+    off_t file_size;
+    uint32_t current_crc;
+    uint32_t delta;
+    unsigned i;
 
-    while(start < end) {
-        off_t i;
-        off_t diff = end - start;
-        if(diff > ((off_t)sizeof(crc_buffer))) { diff = sizeof(crc_buffer); }
-        end -= diff;
+    f = fopen(filename, "r+b");
+    if(!f) { goto error_f; }
 
-        if(fseeko(f, end, SEEK_SET) != 0) {
-            printf("seek error\n");
-            return 1;
-        }
-        if(fread(crc_buffer, 1, (size_t)diff, f) != (size_t)diff) {
-            printf("read error\n");
-            return 1;
-        }
+    if(fseeko(f, 0, SEEK_END) != 0) { goto error_f; }
+    file_size = ftello(f);
+    if(fseeko(f, 0, SEEK_SET) != 0) { goto error_f; }
 
-        for(i = diff; i > 0; i--) {
-            crc = crc_prevbyte(crc, crc_buffer[i - 1]);
-        }
+    if(file_size < 4) {
+        printf("Error: %s: file must be at least 4 bytes\n", filename);
+        goto error;
     }
-    if(result) { *result = crc; }
+    if(*patch_offset < 0) {
+        *patch_offset = file_size - 4;
+    }
+    if(*patch_offset > (file_size - 4)) {
+        printf("Error: %s: offset 0x", filename);
+        fprinthex(stdout, *patch_offset, 1);
+        printf(" is out of range of the file\n");
+        goto error;
+    }
+
+    //
+    // Compute the current CRC, unless it's known already
+    //
+    if(known_crc) {
+        current_crc = *known_crc;
+    } else if(crc_f(0, f, filename, 0, file_size, &current_crc)) {
+        goto error;
+    }
+
+    //
+    // Find the change to the 4 bytes that changes the CRC as desired
+    //
+    delta = crc_unshift(current_crc ^ desired_crc, file_size - *patch_offset);
+
+    if(fseeko(f, *patch_offset, SEEK_SET) != 0) { goto error_f; }
+    if(fread (initial_bytes, 1, 4, f)     != 4) { goto error_f; }
+    for(i = 0; i < 4; i++) {
+        patched_bytes[i] = initial_bytes[i] ^ (uint8_t)(delta >> (8 * i));
+    }
+    //
+    // Write the patched bytes at the patch offset
+    //
+    if(fseeko(f, *patch_offset, SEEK_SET) != 0) { goto error_f; }
+    if(fwrite(patched_bytes, 1, 4, f)     != 4) { goto error_f; }
+    if(fflush(f) != 0) { goto error_f; }
+
+    fclose(f);
     return 0;
+
+error_f:
+    printfileerror(f, filename);
+error:
+    if(f != NULL) { fclose(f); }
+    return 1;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Returns the 4 data bytes necessary to go from current->desired
+// Batch mode
 //
-static uint32_t crc32_preimage(uint32_t current_crc, uint32_t desired_crc) {
-    uint32_t x = desired_crc ^ 0x2144DF1Clu;
-    return current_crc ^
-        (  x               & 0x47FF01FFlu) ^ (((x<< 1)|(x>>31)) & 0x8F0003C1lu) ^
-        (((x<< 2)|(x>>30)) & 0xFE0FFE03lu) ^ (((x<< 3)|(x>>29)) & 0x3FE003C0lu) ^
-        (((x<< 4)|(x>>28)) & 0x7830FE00lu) ^ (((x<< 5)|(x>>27)) & 0xF01F03DFlu) ^
-        (((x<< 6)|(x>>26)) & 0x00C001C0lu) ^ (((x<< 7)|(x>>25)) & 0x3E00FC40lu) ^
-        (((x<< 8)|(x>>24)) & 0x7F0FFEC0lu) ^ (((x<< 9)|(x>>23)) & 0xF9EF03FFlu) ^
-        (((x<<10)|(x>>22)) & 0x0FDFFE00lu) ^ (((x<<11)|(x>>21)) & 0x07CF05C0lu) ^
-        (((x<<12)|(x>>20)) & 0x30E00C00lu) ^ (((x<<13)|(x>>19)) & 0x7ECF0000lu) ^
-        (((x<<14)|(x>>18)) & 0xC1E001FFlu) ^ (((x<<15)|(x>>17)) & 0x78CF03C0lu) ^
-        (((x<<16)|(x>>16)) & 0xF61FFFFFlu) ^ (((x<<17)|(x>>15)) & 0x0F310000lu) ^
-        (((x<<18)|(x>>14)) & 0x39E0FE00lu) ^ (((x<<19)|(x>>13)) & 0x4F37FC00lu) ^
-        (((x<<20)|(x>>12)) & 0x8610003Flu) ^ (((x<<21)|(x>>11)) & 0xCF30FFFFlu) ^
-        (((x<<22)|(x>>10)) & 0x79EFFFC0lu) ^ (((x<<23)|(x>> 9)) & 0xCF2001FFlu) ^
-        (((x<<24)|(x>> 8)) & 0x793FFC00lu) ^ (((x<<25)|(x>> 7)) & 0xCF0F01FFlu) ^
-        (((x<<26)|(x>> 6)) & 0x7AE003C0lu) ^ (((x<<27)|(x>> 5)) & 0xC9C0003Flu) ^
-        (((x<<28)|(x>> 4)) & 0x78000000lu) ^ (((x<<29)|(x>> 3)) & 0xD70FFE3Flu) ^
-        (((x<<30)|(x>> 2)) & 0x4E1F0200lu) ^ (((x<<31)|(x>> 1)) & 0xC03FFC3Flu);
+// Each line of the list is "file desired_crc offset", where the offset may be
+// "-" for the last 4 bytes.  Blank lines and lines starting with ';' are
+// skipped.  For each file patched, one line is printed:
+//   offset old_bytes new_bytes crc file
+// all in hex.  The next file is read ahead while the current one is hashed.
+//
+struct batchentry {
+    char*    name;
+    uint32_t desired_crc;
+    off_t    offset;
+};
+
+static const off_t READAHEAD_MAX = 0x4000000L;
+
+static void batch_prefetch(const struct batchentry* e) {
+    struct stat mystat;
+    if(stat(e->name, &mystat) < 0) { return; }
+    prefetchfile(e->name,
+        (mystat.st_size < READAHEAD_MAX) ? mystat.st_size : READAHEAD_MAX
+    );
+}
+
+//
+// Read one line into a growable buffer
+// Returns 0 on success, -1 on end-of-file, or 1 on error
+//
+static int batch_readline(FILE* f, char** line, size_t* linesize) {
+    size_t len = 0;
+    int c;
+    for(;;) {
+        if(len + 1 >= *linesize) {
+            size_t newsize = (*linesize) ? 2 * (*linesize) : 256;
+            char* newline;
+            if(newsize < *linesize) {
+                printf("Out of memory\n");
+                return 1;
+            }
+            newline = realloc(*line, newsize);
+            if(!newline) {
+                printf("Out of memory\n");
+                return 1;
+            }
+            *line = newline;
+            *linesize = newsize;
+        }
+        c = fgetc(f);
+        if(c == EOF && !len) { return ferror(f) ? 1 : -1; }
+        if(c == EOF || c == '\n') { break; }
+        (*line)[len++] = (char)c;
+    }
+    (*line)[len] = 0;
+    return ferror(f) ? 1 : 0;
+}
+
+//
+// Parse one line of the list in place
+// Returns 0 if it's an entry, 1 if it should be skipped, -1 if it's malformed
+//
+static int batch_parse(char* line, struct batchentry* e) {
+    char* p;
+    char* end;
+    size_t len = strlen(line);
+    while(len && isspace((uint8_t)line[len - 1])) { line[--len] = 0; }
+    while(isspace((uint8_t)*line)) { line++; }
+    if(!*line || *line == ';') { return 1; }
+    //
+    // Offset and CRC are the last two fields; the rest is the filename
+    //
+    p = line + strlen(line);
+    while(p > line && !isspace((uint8_t)p[-1])) { p--; }
+    if(p == line) { return -1; }
+    if(!strcmp(p, "-")) {
+        e->offset = -1;
+    } else {
+        e->offset = strtoofft(p, &end, 0);
+        if(end == p || *end || e->offset < 0) { return -1; }
+    }
+    while(p > line && isspace((uint8_t)p[-1])) { p--; }
+    *p = 0;
+    while(p > line && !isspace((uint8_t)p[-1])) { p--; }
+    if(p == line) { return -1; }
+    e->desired_crc = strtoul(p, &end, 0);
+    if(end == p || *end) { return -1; }
+    while(p > line && isspace((uint8_t)p[-1])) { p--; }
+    *p = 0;
+    if(!*line) { return -1; }
+    e->name = line;
+    return 0;
+}
+
+static int batch(const char* listfilename) {
+    char* line = NULL;
+    size_t linesize = 0;
+    FILE* f = NULL;
+    struct batchentry* entry = NULL;
+    size_t nentries = 0;
+    size_t entries_size = 0;
+    size_t nfailed = 0;
+    size_t i;
+    unsigned long linenum = 0;
+    int returncode = 0;
+
+    f = fopen(listfilename, "rb");
+    if(!f) { goto error_f; }
+    for(;;) {
+        struct batchentry e;
+        int r = batch_readline(f, &line, &linesize);
+        if(r > 0) {
+            if(ferror(f)) { goto error_f; }
+            goto error;
+        }
+        if(r < 0) { break; }
+        linenum++;
+        r = batch_parse(line, &e);
+        if(r > 0) { continue; }
+        if(r < 0) {
+            printf("Error: %s: line %lu is malformed\n", listfilename, linenum);
+            goto error;
+        }
+        if(nentries >= entries_size) {
+            size_t newsize = entries_size ? 2 * entries_size : 64;
+            struct batchentry* newentry;
+            if(
+                newsize < entries_size ||
+                newsize > (((size_t)(-1)) / sizeof(*entry))
+            ) {
+                printf("Out of memory\n");
+                goto error;
+            }
+            newentry = realloc(entry, newsize * sizeof(*entry));
+            if(!newentry) {
+                printf("Out of memory\n");
+                goto error;
+            }
+            entry = newentry;
+            entries_size = newsize;
+        }
+        entry[nentries] = e;
+        entry[nentries].name = malloc(strlen(e.name) + 1);
+        if(!entry[nentries].name) {
+            printf("Out of memory\n");
+            goto error;
+        }
+        strcpy(entry[nentries].name, e.name);
+        nentries++;
+    }
+    fclose(f);
+    f = NULL;
+
+    if(nentries) {
+        batch_prefetch(entry);
+    }
+    for(i = 0; i < nentries; i++) {
+        uint8_t initial_bytes[4];
+        uint8_t patched_bytes[4];
+        off_t offset = entry[i].offset;
+        if(i + 1 < nentries) {
+            batch_prefetch(entry + i + 1);
+        }
+        if(force_crc(
+            entry[i].name, NULL, entry[i].desired_crc,
+            &offset, initial_bytes, patched_bytes
+        )) {
+            nfailed++;
+            continue;
+        }
+        fprinthex(stdout, offset, 8);
+        printf(" %02X%02X%02X%02X %02X%02X%02X%02X %08lX %s\n",
+            initial_bytes[0], initial_bytes[1],
+            initial_bytes[2], initial_bytes[3],
+            patched_bytes[0], patched_bytes[1],
+            patched_bytes[2], patched_bytes[3],
+            (unsigned long)(entry[i].desired_crc),
+            entry[i].name
+        );
+    }
+    if(nfailed) {
+        printf("%lu of %lu file%s failed\n",
+            (unsigned long)nfailed, (unsigned long)nentries,
+            nentries == 1 ? "" : "s"
+        );
+        returncode = 1;
+    }
+    goto done;
+
+error_f:
+    printfileerror(f, listfilename);
+error:
+    returncode = 1;
+
+done:
+    if(f != NULL) { fclose(f); }
+    if(line != NULL) { free(line); }
+    if(entry != NULL) {
+        for(i = 0; i < nentries; i++) {
+            free(entry[i].name);
+        }
+        free(entry);
+    }
+    return returncode;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -151,15 +460,15 @@ int main(
     int returncode = 0;
 
     FILE *f = NULL;
+    const char *filename;
     uint32_t i;
     uint32_t desired_crc = 0;
+    uint32_t current_crc = 0;
+    int current_known = 0;
+    int argi = 1;
 
     off_t file_size;
-    off_t patch_offset;
-
-    uint32_t pre_crc  = 0;
-    uint32_t post_crc = 0;
-    uint32_t preimage = 0;
+    off_t patch_offset = -1;
 
     uint8_t initial_bytes[4];
     uint8_t patched_bytes[4];
@@ -168,92 +477,75 @@ int main(
 
     crc_init();
 
-    if(argc != 2 && argc != 3 && argc != 4) {
+    if(argc == 3 && !strcmp(argv[1], "-batch")) {
+        return batch(argv[2]);
+    }
+
+    if(argc >= 3 && !strcmp(argv[1], "-c")) {
+        current_crc = strtoul(argv[2], NULL, 0);
+        current_known = 1;
+        argi = 3;
+    }
+
+    if(
+        (argc - argi) < (current_known ? 2 : 1) ||
+        (argc - argi) > 3
+    ) {
         banner();
         printf(
             "Usage:\n"
             "To obtain the CRC32 of a file:\n"
             "    %s file\n"
             "To modify the CRC32 of a file:\n"
-            "    %s file desired_crc [offset]\n"
+            "    %s [-c current_crc] file desired_crc [offset]\n"
+            "To modify the CRC32s of every file in a list:\n"
+            "    %s -batch listfile\n"
             "Patches 4 consecutive bytes at the given offset to force the file's CRC32.\n"
-            "If no offset is given, the last 4 bytes of the file are used.\n",
+            "If no offset is given, the last 4 bytes of the file are used.\n"
+            "If the file's current CRC32 is given with -c, only those 4 bytes are read.\n",
+            argv[0],
             argv[0],
             argv[0]
         );
         goto error;
     }
+    filename = argv[argi];
 
-    if(argc == 2) {
+    if((argc - argi) == 1) {
         //
         // Just get the file's CRC
         //
-        f = fopen(argv[1], "rb");
+        f = fopen(filename, "rb");
         if(!f) { goto error_f; }
 
         if(fseeko(f, 0, SEEK_END) != 0) { goto error_f; }
         file_size = ftello(f);
         if(fseeko(f, 0, SEEK_SET) != 0) { goto error_f; }
 
-        if(crc_f(0, f, 0, file_size, &pre_crc)) { goto error; }
+        if(crc_f(0, f, filename, 0, file_size, &current_crc)) {
+            goto error;
+        }
 
-        printf("0x%08lX\n", (unsigned long)pre_crc);
+        printf("0x%08lX\n", (unsigned long)current_crc);
         goto done;
     }
 
-    if(argc >= 3) {
-        desired_crc = strtoul(argv[2], NULL, 0);
-    }
-
-    f = fopen(argv[1], "r+b");
-    if(!f) { goto error_f; }
+    desired_crc = strtoul(argv[argi + 1], NULL, 0);
 
-    if(fseeko(f, 0, SEEK_END) != 0) { goto error_f; }
-    file_size = ftello(f);
-    if(fseeko(f, 0, SEEK_SET) != 0) { goto error_f; }
-
-    if(file_size < 4) {
-        printf("error: file must be at least 4 bytes\n");
-        goto error;
-    }
-    patch_offset = file_size - 4;
-    if(argc >= 4) {
-        patch_offset = strtoofft(argv[3], NULL, 0);
+    if((argc - argi) >= 3) {
+        patch_offset = strtoofft(argv[argi + 2], NULL, 0);
         if(patch_offset < 0) {
             printf("patch offset must not be negative\n");
             goto error;
         }
     }
-    if(patch_offset > (file_size - 4)) {
-        printf("offset 0x");
-        fprinthex(stdout, patch_offset, 1);
-        printf(" is out of range of the file\n");
+
+    if(force_crc(
+        filename, current_known ? &current_crc : NULL, desired_crc,
+        &patch_offset, initial_bytes, patched_bytes
+    )) {
         goto error;
     }
-
-    //
-    // Compute pre- and post-crc
-    //
-    if(crc_f(0x00000000 , f, 0               , patch_offset, &pre_crc )) { goto error; }
-    if(crc_r(desired_crc, f, patch_offset + 4, file_size   , &post_crc)) { goto error; }
-
-    //
-    // Compute preimage from pre to post
-    //
-    preimage = crc32_preimage(pre_crc, post_crc);
-
-    patched_bytes[0] = (uint8_t)(preimage >>  0);
-    patched_bytes[1] = (uint8_t)(preimage >>  8);
-    patched_bytes[2] = (uint8_t)(preimage >> 16);
-    patched_bytes[3] = (uint8_t)(preimage >> 24);
-    //
-    // Write preimage at the patch offset
-    //
-    if(fseeko(f, patch_offset, SEEK_SET) != 0) { goto error_f; }
-    if(fread (initial_bytes, 1, 4, f)    != 4) { goto error_f; }
-    if(fseeko(f, patch_offset, SEEK_SET) != 0) { goto error_f; }
-    if(fwrite(patched_bytes, 1, 4, f)    != 4) { goto error_f; }
-    fflush(f);
     //
     // Done
     //
@@ -267,7 +559,7 @@ int main(
     goto done;
 
 error_f:
-    printfileerror(f, argv[1]);
+    printfileerror(f, filename);
 error:
     returncode = 1;
 
@@ -23,125 +23,876 @@
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void report(
+void report_bytes(
     off_t          filepos,
     const uint8_t* src,
-    size_t         len,
-    const char*    type
+    size_t         len
 ) {
+    static const char hex[] = "0123456789ABCDEF";
+    char   line[3 * 64];
+    size_t n = 0;
     fprinthex(stdout, filepos, 8);
-    printf(": ");
+    fputs(": ", stdout);
     while(len--) {
         uint8_t c = *src++;
-        printf("%02X ", c);
+        line[n++] = hex[c >> 4];
+        line[n++] = hex[c & 15];
+        line[n++] = ' ';
+        if(n == sizeof(line)) {
+            fwrite(line, 1, n, stdout);
+            n = 0;
+        }
     }
+    fwrite(line, 1, n, stdout);
+}
+
+void report(
+    off_t          filepos,
+    const uint8_t* src,
+    size_t         len,
+    const char*    type
+) {
+    report_bytes(filepos, src, len);
     printf("(%s)\n", type);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Search variants
+//
+// Each variant reads a value every "stride" bytes, either a single byte or a
+// 16-bit word, and expects the differences between those values to be the
+// differences between characters times "scale".  Every variant is tried at
+// every position.  At any one position, only the first matching variant of a
+// given shape (stride and value size) is reported.
+//
+struct variant {
+    size_t         stride;
+    int            scale;
+    int            width;     // bytes per value: 1 or 2
+    int            bigendian; // for 16-bit values
+    char           type[32];
+    //
+    // Filled in by variant_init
+    //
+    size_t         span;     // bytes covered by a match
+    size_t         anchor;   // low byte of the first non-wildcard character
+    size_t         gap;      // distance from there to the next one
+    uint8_t        want;     // difference between those two bytes, mod 256
+    uint8_t*       delta;    // delta[i] = buffer[i + gap] - buffer[i]
+    int            owndelta; // nonzero if delta isn't shared
+};
+
+enum {
+    MAXVARIANTS = 32,
+    MAXSTRIDE   = 64,
+    MAXSCALE    = 255
+};
+
+static struct variant variants[MAXVARIANTS];
+static size_t         nvariants = 0;
+
+static int sameshape(const struct variant* a, const struct variant* b) {
+    return
+        a->stride    == b->stride &&
+        a->width     == b->width  &&
+        a->bigendian == b->bigendian;
+}
+
+//
+// Add a variant to the list
+// Returns nonzero on error
+//
+static int variant_add(size_t stride, int scale, int width, int bigendian) {
+    struct variant* v;
+    size_t len;
+    if(nvariants >= MAXVARIANTS) {
+        printf("Too many search variants\n");
+        return 1;
+    }
+    v = variants + (nvariants++);
+    memset(v, 0, sizeof(*v));
+    v->stride    = stride;
+    v->scale     = scale;
+    v->width     = width;
+    v->bigendian = bigendian;
+    //
+    // The original four variants keep their names: normal, double, wide, and
+    // wide double
+    //
+    if(width == 2) {
+        sprintf(v->type, "16-bit %s", bigendian ? "BE" : "LE");
+    } else if(stride == 2) {
+        strcpy(v->type, "wide");
+    } else if(stride != 1) {
+        sprintf(v->type, "stride %lu", (unsigned long)stride);
+    }
+    len = strlen(v->type);
+    if(scale != 1) {
+        if(len) { v->type[len++] = ' '; }
+        if(scale == 2) {
+            strcpy(v->type + len, "double");
+        } else {
+            sprintf(v->type + len, "x%d", scale);
+        }
+    } else if(!len) {
+        strcpy(v->type, "normal");
+    }
+    return 0;
+}
+
+//
+// Read one value, as a variant sees it
+//
+static long variant_value(const struct variant* v, const uint8_t* p) {
+    if(v->width == 1) { return p[0]; }
+    if(v->bigendian) {
+        return (((long)(p[0])) << 8) | p[1];
+    } else {
+        return (((long)(p[1])) << 8) | p[0];
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 int matchtest(
-    const uint8_t* string,
-    const uint8_t* buffer,
-    size_t         increment,
-    int            shift
+    const uint8_t*        string,
+    const uint8_t*        buffer,
+    const struct variant* v
 ) {
-    int16_t stringstart;
-    int16_t bufferstart;
+    long stringstart;
+    long bufferstart;
     for(;;) {
         uint8_t c = *string;
         if(!c) { return 1; }
         if(c != '.') {
-            stringstart = ((int16_t)( c     )) & 0xFF;
-            bufferstart = ((int16_t)(*buffer)) & 0xFF;
+            stringstart = c;
+            bufferstart = variant_value(v, buffer);
             break;
         }
         string++;
-        buffer += increment;
+        buffer += v->stride;
     }
     for(;;) {
         uint8_t c = *string;
         if(!c) { break; }
         if(c != '.') {
-            int16_t stringnow = ((int16_t)( c     )) & 0xFF;
-            int16_t buffernow = ((int16_t)(*buffer)) & 0xFF;
-            stringnow -= stringstart;
-            buffernow -= bufferstart;
-            stringnow <<= shift;
+            long stringnow = (((long)c) - stringstart) * v->scale;
+            long buffernow = variant_value(v, buffer) - bufferstart;
             if(stringnow != buffernow) { return 0; }
         }
         string++;
-        buffer += increment;
+        buffer += v->stride;
     }
     return 1;
 }
 
+//
+// Work out where each variant's first two non-wildcard characters fall
+// Returns nonzero on error
+//
+static int variant_init(
+    struct variant* v,
+    size_t          nv,
+    const uint8_t*  string,
+    size_t          stringlen,
+    size_t          buffersize
+) {
+    size_t i, j, k;
+    for(i = 0; string[i] == '.'; i++) { }
+    for(j = i + 1; string[j] == '.'; j++) { }
+    for(k = 0; k < nv; k++) {
+        size_t m;
+        v[k].span   = (stringlen - 1) * v[k].stride + v[k].width;
+        v[k].anchor = i * v[k].stride;
+        if(v[k].width == 2 && v[k].bigendian) { v[k].anchor++; }
+        v[k].gap    = (j - i) * v[k].stride;
+        v[k].want   = (uint8_t)(
+            ((long)(string[j]) - (long)(string[i])) * v[k].scale
+        );
+        //
+        // Share the delta stream with an earlier variant if possible
+        //
+        for(m = 0; m < k; m++) {
+            if(v[m].gap == v[k].gap) { break; }
+        }
+        if(m < k) {
+            v[k].delta    = v[m].delta;
+            v[k].owndelta = 0;
+        } else {
+            v[k].delta    = malloc(buffersize);
+            v[k].owndelta = 1;
+            if(!v[k].delta) {
+                printf("Out of memory\n");
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void variant_free(struct variant* v, size_t nv) {
+    size_t k;
+    for(k = 0; k < nv; k++) {
+        if(v[k].owndelta) { free(v[k].delta); }
+        v[k].delta    = NULL;
+        v[k].owndelta = 0;
+    }
+}
+
+//
+// Find the next position, from start up to limit, where a variant might match
+// Returns limit if there isn't one
+//
+static size_t variant_next(
+    const struct variant* v,
+    size_t                start,
+    size_t                limit,
+    size_t                bufferlen
+) {
+    const uint8_t* p;
+    size_t end = limit;
+    if(bufferlen < v->span) { return limit; }
+    if(end > bufferlen - v->span + 1) {
+        end = bufferlen - v->span + 1;
+    }
+    if(start >= end) { return limit; }
+    p = memchr(v->delta + start + v->anchor, v->want, end - start);
+    return p ? (size_t)(p - (v->delta + v->anchor)) : limit;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
+//
+// Multi-pattern search
+//
+// Each pattern's longest run without wildcards is turned into the differences
+// between its adjacent characters, once for each scale, and all of these go
+// into one Aho-Corasick automaton.  For each stride, the automaton is run over
+// the differences between bytes that far apart, following each position
+// modulo the stride separately.  Those differences are the same mod 256 in
+// the low bytes of 16-bit values, so one run covers those too.  Every hit is
+// checked with matchtest.
+//
+struct pattern {
+    const uint8_t* string;
+    size_t         len;
+    size_t         run;     // start of the longest run without wildcards
+    size_t         runlen;  // its length, at least 2
+};
 
-off_t relsearch(
-    const uint8_t* string,
-    const char*    filename
+struct ackey {
+    size_t pattern;
+    int    scale;
+    size_t next;    // next key ending at the same node, plus 1; 0 if none
+};
+
+struct acnode {
+    size_t  child;   // first child, 0 if none
+    size_t  sibling; // next sibling, 0 if none
+    size_t  fail;
+    size_t  dict;    // nearest node down the fail chain with keys, 0 if none
+    size_t  key;     // first key ending here, plus 1; 0 if none
+    uint8_t byte;
+};
+
+struct acmachine {
+    struct acnode* node;
+    size_t         nnodes;
+    size_t         nodes_size;
+    struct ackey*  key;
+    size_t         nkeys;
+    size_t         root[256]; // transitions out of the root (node 0)
+};
+
+//
+// Returns the new node, or 0 if out of memory
+//
+static size_t ac_newnode(struct acmachine* m, size_t parent, uint8_t byte) {
+    struct acnode* n;
+    if(m->nnodes >= m->nodes_size) {
+        size_t newsize = m->nodes_size ? 2 * m->nodes_size : 256;
+        struct acnode* newnode;
+        if(
+            newsize < m->nodes_size ||
+            newsize > (((size_t)(-1)) / sizeof(*newnode))
+        ) {
+            return 0;
+        }
+        newnode = realloc(m->node, newsize * sizeof(*newnode));
+        if(!newnode) { return 0; }
+        m->node = newnode;
+        m->nodes_size = newsize;
+    }
+    n = m->node + m->nnodes;
+    memset(n, 0, sizeof(*n));
+    n->byte = byte;
+    if(m->nnodes) {
+        n->sibling = m->node[parent].child;
+        m->node[parent].child = m->nnodes;
+    }
+    return m->nnodes++;
+}
+
+static size_t ac_child(const struct acmachine* m, size_t n, uint8_t byte) {
+    size_t c;
+    for(c = m->node[n].child; c; c = m->node[c].sibling) {
+        if(m->node[c].byte == byte) { return c; }
+    }
+    return 0;
+}
+
+static size_t ac_step(const struct acmachine* m, size_t n, uint8_t byte) {
+    for(;;) {
+        size_t c;
+        if(!n) { return m->root[byte]; }
+        c = ac_child(m, n, byte);
+        if(c) { return c; }
+        n = m->node[n].fail;
+    }
+}
+
+//
+// Build the automaton for every pattern
+// Returns nonzero on error
+//
+static int ac_build(
+    struct acmachine*     m,
+    const struct pattern* pattern,
+    size_t                npatterns
 ) {
-    FILE*    f = NULL;
-    uint8_t* buffer = NULL;
+    size_t* queue = NULL;
+    size_t  head, tail;
+    size_t  i, v;
 
-    size_t   stringlen;
-    size_t   buffersize;
-    off_t    matchesfound = 0;
-    off_t    bufferbase;
-    size_t   bufferpos;
-    size_t   bufferlen;
+    memset(m, 0, sizeof(*m));
+    if(
+        npatterns > (((size_t)(-1)) / (MAXVARIANTS * sizeof(*(m->key))))
+    ) {
+        goto nomem;
+    }
+    m->key = malloc(MAXVARIANTS * npatterns * sizeof(*(m->key)));
+    if(!m->key) { goto nomem; }
+    ac_newnode(m, 0, 0);
+    if(!m->nnodes) { goto nomem; }
+    //
+    // Trie of every key
+    //
+    for(i = 0; i < npatterns; i++) {
+        const uint8_t* s = pattern[i].string + pattern[i].run;
+        for(v = 0; v < nvariants; v++) {
+            struct ackey* k = m->key + m->nkeys;
+            int scale = variants[v].scale;
+            size_t n = 0;
+            size_t j;
+            //
+            // One key per distinct scale
+            //
+            for(j = 0; j < v; j++) {
+                if(variants[j].scale == scale) { break; }
+            }
+            if(j < v) { continue; }
+            for(j = 0; j + 1 < pattern[i].runlen; j++) {
+                uint8_t byte = (uint8_t)(
+                    ((long)(s[j + 1]) - (long)(s[j])) * scale
+                );
+                size_t c = ac_child(m, n, byte);
+                if(!c) {
+                    c = ac_newnode(m, n, byte);
+                    if(!c) { goto nomem; }
+                }
+                n = c;
+            }
+            k->pattern = i;
+            k->scale   = scale;
+            k->next    = m->node[n].key;
+            m->node[n].key = ++(m->nkeys);
+        }
+    }
+    for(i = 0; i < 256; i++) {
+        m->root[i] = ac_child(m, 0, (uint8_t)i);
+    }
+    //
+    // Fail links, breadth first
+    //
+    if(m->nnodes > (((size_t)(-1)) / sizeof(*queue))) { goto nomem; }
+    queue = malloc(m->nnodes * sizeof(*queue));
+    if(!queue) { goto nomem; }
+    head = 0;
+    tail = 0;
+    queue[tail++] = 0;
+    while(head < tail) {
+        size_t n = queue[head++];
+        size_t c;
+        for(c = m->node[n].child; c; c = m->node[c].sibling) {
+            size_t f = n ? ac_step(m, m->node[n].fail, m->node[c].byte) : 0;
+            m->node[c].fail = f;
+            m->node[c].dict = m->node[f].key ? f : m->node[f].dict;
+            queue[tail++] = c;
+        }
+    }
+    free(queue);
+    return 0;
+
+nomem:
+    printf("Out of memory\n");
+    if(queue) { free(queue); }
+    return 1;
+}
+
+static void ac_free(struct acmachine* m) {
+    if(m->node) { free(m->node); }
+    if(m->key ) { free(m->key ); }
+    memset(m, 0, sizeof(*m));
+}
+
+//
+// A match found in the current buffer, waiting to be reported in order
+//
+struct hit {
+    size_t pos;
+    size_t pattern;
+    size_t variant;
+};
+
+static int hit_compare(const void* a, const void* b) {
+    const struct hit* x = (const struct hit*)a;
+    const struct hit* y = (const struct hit*)b;
+    if(x->pos     != y->pos    ) { return (x->pos     < y->pos    ) ? -1 : 1; }
+    if(x->pattern != y->pattern) { return (x->pattern < y->pattern) ? -1 : 1; }
+    if(x->variant != y->variant) { return (x->variant < y->variant) ? -1 : 1; }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Search state shared by every file
+//
+struct search {
+    const uint8_t*   string;     // NULL when searching for several patterns
+    size_t           stringlen;
+    struct pattern*  pattern;
+    size_t           npatterns;
+    struct acmachine ac;
+    uint8_t*         delta;      // buffer[i + stride] - buffer[i]
+    struct hit*      hit;
+    size_t           nhits;
+    size_t           hits_size;
+    size_t           maxspan;
+    uint8_t*         buffer;
+    size_t           buffersize;
+};
+
+//
+// Allocate the buffer, once maxspan is known
+// Returns nonzero on error
+//
+static int search_alloc(struct search* s) {
+    s->buffersize = 2 * s->maxspan;
+    if(s->buffersize < 0x8000) {
+        s->buffersize = 0x8000;
+    }
+    s->buffer = malloc(s->buffersize);
+    if(!s->buffer) {
+        printf("Out of memory\n");
+        return 1;
+    }
+    return 0;
+}
 
+//
+// Returns nonzero on error
+//
+static int search_init(struct search* s, const uint8_t* string) {
+    size_t k;
+    memset(s, 0, sizeof(*s));
+    s->string = string;
     //
     // Examine length of search string
     //
-    stringlen = strlen((const char*)string);
+    s->stringlen = strlen((const char*)string);
     // Avoid overflow
-    if(stringlen > (((size_t)(-1)) / 2)) {
+    if(s->stringlen > (((size_t)(-1)) / (4 * MAXSTRIDE))) {
         printf("String is too long\n"); // very rare case
-        goto done;                      // very rare case
+        return 1;                        // very rare case
+    }
+    for(k = 0; k < nvariants; k++) {
+        size_t span = (s->stringlen - 1) * variants[k].stride +
+            variants[k].width;
+        if(span > s->maxspan) { s->maxspan = span; }
     }
     //
-    // Allocate buffer
+    // Allocate buffer, and one difference stream per distinct gap
     //
-    buffersize = 2 * stringlen - 1;
-    if(buffersize < 4096) {
-        buffersize = 4096;
+    if(search_alloc(s)) { return 1; }
+    return variant_init(
+        variants, nvariants, string, s->stringlen, s->buffersize
+    );
+}
+
+//
+// Set up to search for several patterns at once
+// Returns nonzero on error
+//
+static int search_init_multi(
+    struct search*  s,
+    struct pattern* pattern,
+    size_t          npatterns
+) {
+    size_t i, k;
+    memset(s, 0, sizeof(*s));
+    s->pattern   = pattern;
+    s->npatterns = npatterns;
+    for(i = 0; i < npatterns; i++) {
+        if(pattern[i].len > (((size_t)(-1)) / (4 * MAXSTRIDE))) {
+            printf("String is too long\n"); // very rare case
+            return 1;                        // very rare case
+        }
+        for(k = 0; k < nvariants; k++) {
+            size_t span = (pattern[i].len - 1) * variants[k].stride +
+                variants[k].width;
+            if(span > s->maxspan) { s->maxspan = span; }
+        }
     }
-    buffer = malloc(buffersize);
-    if(!buffer) {
+    if(search_alloc(s)) { return 1; }
+    s->delta = malloc(s->buffersize);
+    if(!s->delta) {
         printf("Out of memory\n");
-        goto done;
+        return 1;
     }
+    return ac_build(&(s->ac), pattern, npatterns);
+}
+
+static void search_free(struct search* s) {
+    if(s->buffer != NULL) { free(s->buffer); }
+    if(s->delta  != NULL) { free(s->delta ); }
+    if(s->hit    != NULL) { free(s->hit   ); }
+    s->buffer = NULL;
+    s->delta  = NULL;
+    s->hit    = NULL;
+    ac_free(&(s->ac));
+    variant_free(variants, nvariants);
+}
+
+//
+// Ask the OS to start reading a file that will be searched soon
+//
+static const off_t READAHEAD_MAX = 0x4000000L;
+
+static void search_prefetch(const char* filename) {
+    struct stat mystat;
+    if(stat(filename, &mystat) < 0) { return; }
+    prefetchfile(filename,
+        (mystat.st_size < READAHEAD_MAX) ? mystat.st_size : READAHEAD_MAX
+    );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Search one buffer for a single string
+//
+// Positions from limit on are left for the next buffer.
+//
+static void search_buffer(
+    struct search* s,
+    off_t          bufferbase,
+    size_t         bufferlen,
+    size_t         limit,
+    off_t*         matchesfound
+) {
+    const uint8_t* buffer = s->buffer;
+    size_t next[MAXVARIANTS];
+    size_t pos;
+    size_t k;
+    //
+    // Transform the buffer into differences between bytes
+    //
+    for(k = 0; k < nvariants; k++) {
+        size_t gap = variants[k].gap;
+        size_t i;
+        if(!variants[k].owndelta || bufferlen <= gap) { continue; }
+        for(i = 0; i < bufferlen - gap; i++) {
+            variants[k].delta[i] = buffer[i + gap] - buffer[i];
+        }
+    }
+    for(k = 0; k < nvariants; k++) {
+        next[k] = variant_next(variants + k, 0, limit, bufferlen);
+    }
+    //
+    // Visit each position where some variant might match, in order, trying
+    // every variant there in one go
+    //
+    for(;;) {
+        size_t matched[MAXVARIANTS];
+        size_t nmatched = 0;
+        pos = limit;
+        for(k = 0; k < nvariants; k++) {
+            if(next[k] < pos) { pos = next[k]; }
+        }
+        if(pos >= limit) { break; }
+        for(k = 0; k < nvariants; k++) {
+            const struct variant* v = variants + k;
+            size_t m;
+            if(next[k] != pos) { continue; }
+            next[k] = variant_next(v, pos + 1, limit, bufferlen);
+            for(m = 0; m < nmatched; m++) {
+                if(sameshape(variants + matched[m], v)) { break; }
+            }
+            if(m < nmatched) { continue; }
+            if(!matchtest(s->string, buffer + pos, v)) {
+                continue;
+            }
+            matched[nmatched++] = k;
+            if(*matchesfound < 1) printf("\n");
+            (*matchesfound)++;
+            report(bufferbase + pos, buffer + pos, v->span, v->type);
+        }
+    }
+}
+
+//
+// Remember a match until the whole buffer has been searched
+// Returns nonzero on error
+//
+static int search_addhit(
+    struct search* s,
+    size_t         pos,
+    size_t         pattern,
+    size_t         variant
+) {
+    if(s->nhits >= s->hits_size) {
+        size_t newsize = s->hits_size ? 2 * s->hits_size : 64;
+        struct hit* newhit;
+        if(
+            newsize < s->hits_size ||
+            newsize > (((size_t)(-1)) / sizeof(*newhit))
+        ) {
+            printf("Out of memory\n");
+            return 1;
+        }
+        newhit = realloc(s->hit, newsize * sizeof(*newhit));
+        if(!newhit) {
+            printf("Out of memory\n");
+            return 1;
+        }
+        s->hit = newhit;
+        s->hits_size = newsize;
+    }
+    s->hit[s->nhits].pos     = pos;
+    s->hit[s->nhits].pattern = pattern;
+    s->hit[s->nhits].variant = variant;
+    s->nhits++;
+    return 0;
+}
+
+//
+// Check a hit from the automaton against every variant it could be
+// Returns nonzero on error
+//
+static int search_hit(
+    struct search*      s,
+    const struct ackey* k,
+    size_t              runstart, // low byte where the run begins
+    size_t              stride,
+    size_t              bufferlen,
+    size_t              limit
+) {
+    const struct pattern* p = s->pattern + k->pattern;
+    size_t v;
+    if(runstart < p->run * stride) { return 0; }
+    for(v = 0; v < nvariants; v++) {
+        const struct variant* var = variants + v;
+        size_t pos = runstart - p->run * stride;
+        if(var->stride != stride || var->scale != k->scale) { continue; }
+        if(var->width == 2 && var->bigendian) {
+            if(!pos) { continue; }
+            pos--;
+        }
+        if(pos >= limit) { continue; }
+        if(bufferlen - pos < (p->len - 1) * stride + var->width) { continue; }
+        if(!matchtest(p->string, s->buffer + pos, var)) { continue; }
+        if(search_addhit(s, pos, k->pattern, v)) { return 1; }
+    }
+    return 0;
+}
+
+//
+// Check every key ending at an automaton node
+// Returns nonzero on error
+//
+static int search_node(
+    struct search* s,
+    size_t         node,
+    size_t         end,       // low byte of the last character of the run
+    size_t         stride,
+    size_t         bufferlen,
+    size_t         limit
+) {
+    const struct acmachine* m = &(s->ac);
+    if(!m->node[node].key) { node = m->node[node].dict; }
+    for(; node; node = m->node[node].dict) {
+        size_t ki;
+        for(ki = m->node[node].key; ki; ki = m->key[ki - 1].next) {
+            const struct ackey* k = m->key + (ki - 1);
+            size_t span = (s->pattern[k->pattern].runlen - 1) * stride;
+            if(end < span) { continue; }
+            if(search_hit(s, k, end - span, stride, bufferlen, limit)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+//
+// Report a match from a multi-pattern search, with the character map it
+// implies
+//
+static void report_multi(
+    off_t                 filepos,
+    const uint8_t*        src,
+    const struct pattern* p,
+    size_t                variant
+) {
+    static const uint8_t mapchars[] = "Aa0";
+    const struct variant* v = variants + variant;
+    long base;
+    long maxcode = (v->width == 1) ? 0xFF : 0xFFFF;
+    size_t i;
+    report_bytes(filepos, src, (p->len - 1) * v->stride + v->width);
+    printf("(%s) \"%s\"", v->type, (const char*)(p->string));
+    //
+    // The run has no wildcards, so it gives a known character and its code
+    //
+    base = variant_value(v, src + p->run * v->stride) -
+        ((long)(p->string[p->run])) * v->scale;
+    for(i = 0; mapchars[i]; i++) {
+        long code = base + ((long)(mapchars[i])) * v->scale;
+        if(code >= 0 && code <= maxcode) {
+            printf(" %c=%0*lX", mapchars[i], 2 * v->width, (unsigned long)code);
+        }
+    }
+    printf("\n");
+}
+
+//
+// Search one buffer for several patterns at once
+// Returns nonzero on error
+//
+static int search_buffer_multi(
+    struct search* s,
+    off_t          bufferbase,
+    size_t         bufferlen,
+    size_t         limit,
+    off_t*         matchesfound
+) {
+    const uint8_t* buffer = s->buffer;
+    size_t state[MAXSTRIDE];
+    size_t i, k, m;
+    s->nhits = 0;
+    //
+    // Once for each distinct stride
+    //
+    for(k = 0; k < nvariants; k++) {
+        size_t stride = variants[k].stride;
+        for(m = 0; m < k; m++) {
+            if(variants[m].stride == stride) { break; }
+        }
+        if(m < k || bufferlen <= stride) { continue; }
+        for(i = 0; i < bufferlen - stride; i++) {
+            s->delta[i] = buffer[i + stride] - buffer[i];
+        }
+        for(i = 0; i < stride; i++) {
+            state[i] = 0;
+        }
+        for(i = 0; i < bufferlen - stride; i++) {
+            size_t* st = state + (i % stride);
+            *st = ac_step(&(s->ac), *st, s->delta[i]);
+            if(
+                *st &&
+                search_node(s, *st, i + stride, stride, bufferlen, limit)
+            ) {
+                return 1;
+            }
+        }
+    }
+    //
+    // Report in order of position, then pattern, then variant
+    //
+    qsort(s->hit, s->nhits, sizeof(*(s->hit)), hit_compare);
+    for(i = 0; i < s->nhits; i++) {
+        const struct hit* h = s->hit + i;
+        //
+        // As with a single string, only the first variant of each shape
+        //
+        for(m = i; m > 0; m--) {
+            const struct hit* g = s->hit + (m - 1);
+            if(g->pos != h->pos || g->pattern != h->pattern) { m = 0; break; }
+            if(sameshape(variants + g->variant, variants + h->variant)) {
+                break;
+            }
+        }
+        if(m > 0) { continue; }
+        if(*matchesfound < 1) printf("\n");
+        (*matchesfound)++;
+        report_multi(
+            bufferbase + h->pos, buffer + h->pos,
+            s->pattern + h->pattern, h->variant
+        );
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+off_t relsearch(
+    struct search* s,
+    const char*    filename
+) {
+    FILE*    f = NULL;
+    uint8_t* buffer     = s->buffer;
+    size_t   buffersize = s->buffersize;
+    size_t   maxspan    = s->maxspan;
+
+    off_t    matchesfound = 0;
+    off_t    bufferbase;
+    size_t   bufferlen;
 
     f = fopen(filename, "rb");
     if(!f) { goto error_f; }
 
     printf("%s: ", filename);
     bufferbase = 0;
-    bufferpos = 0;
     bufferlen = 0;
     for(;;) {
-        size_t readsize;
-        if(bufferlen && ((buffersize - bufferpos) < (2 * stringlen - 1))) {
-            memmove(buffer, buffer + bufferpos, bufferlen);
-            bufferbase += bufferpos;
-            bufferpos = 0;
-        }
-        readsize = buffersize - (bufferpos + bufferlen);
-        if((readsize > 0) && (!feof(f))) {
-            readsize = fread(buffer + (bufferpos + bufferlen), 1, readsize, f);
-            bufferlen += readsize;
-        }
-        if(bufferlen < stringlen) break;
-             if(matchtest(string, buffer + bufferpos, 1, 0)) { if(matchesfound < 1) printf("\n"); matchesfound++; report(bufferbase + bufferpos, buffer + bufferpos, stringlen, "normal"); }
-        else if(matchtest(string, buffer + bufferpos, 1, 1)) { if(matchesfound < 1) printf("\n"); matchesfound++; report(bufferbase + bufferpos, buffer + bufferpos, stringlen, "double"); }
-        if(bufferlen >= (2 * stringlen - 1)) {
-                 if(matchtest(string, buffer + bufferpos, 2, 0)) { if(matchesfound < 1) printf("\n"); matchesfound++; report(bufferbase + bufferpos, buffer + bufferpos, 2 * stringlen - 1, "wide"); }
-            else if(matchtest(string, buffer + bufferpos, 2, 1)) { if(matchesfound < 1) printf("\n"); matchesfound++; report(bufferbase + bufferpos, buffer + bufferpos, 2 * stringlen - 1, "wide double"); }
-        }
-        bufferpos++;
-        bufferlen--;
+        size_t readsize = buffersize - bufferlen;
+        size_t limit;
+        int    eof = 0;
+        readsize = fread(buffer + bufferlen, 1, readsize, f);
+        if(readsize < buffersize - bufferlen) {
+            if(ferror(f)) { goto error_f; }
+            eof = 1;
+        }
+        bufferlen += readsize;
+        //
+        // Positions this close to the end will be searched again next time,
+        // once more data is read
+        //
+        if(eof) {
+            limit = bufferlen;
+        } else {
+            limit = bufferlen - (maxspan - 1);
+        }
+        if(s->string) {
+            search_buffer(s, bufferbase, bufferlen, limit, &matchesfound);
+        } else if(search_buffer_multi(
+            s, bufferbase, bufferlen, limit, &matchesfound
+        )) {
+            goto done;
+        }
+        if(eof) { break; }
+        memmove(buffer, buffer + limit, bufferlen - limit);
+        bufferbase += limit;
+        bufferlen  -= limit;
     }
     printf(
         "%lu match%s found\n",
@@ -155,57 +906,275 @@ error_f:
     printfileerror(f, filename);
 
 done:
-    if(f      != NULL) { fclose(f); }
-    if(buffer != NULL) { free(buffer); }
+    if(f != NULL) { fclose(f); }
 
     return matchesfound;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Load a list of patterns, one per line
+// Returns nonzero on error
+//
+static int load_patterns(
+    const char*      filename,
+    struct pattern** pattern_out,
+    size_t*          npatterns_out
+) {
+    static char line[0x1000];
+    FILE* f = NULL;
+    struct pattern* pattern = NULL;
+    size_t npatterns = 0;
+    size_t patterns_size = 0;
+    unsigned long linenum = 0;
+
+    f = fopen(filename, "rb");
+    if(!f) { goto error_f; }
+    while(fgets(line, sizeof(line), f)) {
+        struct pattern p;
+        size_t len = strlen(line);
+        size_t i, run;
+        char* copy;
+        linenum++;
+        if(len && line[len - 1] == '\n') {
+            line[--len] = 0;
+        } else if(!feof(f)) {
+            printf("Error: %s: line %lu is too long\n", filename, linenum);
+            goto error;
+        }
+        if(len && line[len - 1] == '\r') { line[--len] = 0; }
+        if(!len) { continue; }
+        //
+        // Find the longest run without wildcards
+        //
+        p.len    = len;
+        p.run    = 0;
+        p.runlen = 0;
+        for(i = 0; i < len; i += run + 1) {
+            for(run = 0; (i + run) < len && line[i + run] != '.'; run++) { }
+            if(run > p.runlen) {
+                p.run    = i;
+                p.runlen = run;
+            }
+        }
+        if(p.runlen < 2) {
+            printf(
+                "Error: %s: line %lu must contain at least two non-wildcard "
+                "characters in a row\n", filename, linenum
+            );
+            goto error;
+        }
+        if(npatterns >= patterns_size) {
+            size_t newsize = patterns_size ? 2 * patterns_size : 16;
+            struct pattern* newpattern;
+            if(
+                newsize < patterns_size ||
+                newsize > (((size_t)(-1)) / sizeof(*newpattern))
+            ) {
+                goto nomem;
+            }
+            newpattern = realloc(pattern, newsize * sizeof(*newpattern));
+            if(!newpattern) { goto nomem; }
+            pattern = newpattern;
+            patterns_size = newsize;
+        }
+        copy = malloc(len + 1);
+        if(!copy) { goto nomem; }
+        memcpy(copy, line, len + 1);
+        p.string = (const uint8_t*)copy;
+        pattern[npatterns++] = p;
+    }
+    if(ferror(f)) { goto error_f; }
+    if(!npatterns) {
+        printf("Error: %s has no patterns\n", filename);
+        goto error;
+    }
+    fclose(f);
+    *pattern_out   = pattern;
+    *npatterns_out = npatterns;
+    return 0;
+
+nomem:
+    printf("Out of memory\n");
+    goto error;
+
+error_f:
+    printfileerror(f, filename);
+
+error:
+    if(f != NULL) { fclose(f); }
+    *pattern_out   = pattern;
+    *npatterns_out = npatterns;
+    return 1;
+}
+
+static void free_patterns(struct pattern* pattern, size_t npatterns) {
+    size_t i;
+    if(!pattern) { return; }
+    for(i = 0; i < npatterns; i++) {
+        free((void*)(pattern[i].string));
+    }
+    free(pattern);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 int main(int argc, char **argv) {
-    const uint8_t* string;
+    const uint8_t* string = NULL;
+    const char* patternfile = NULL;
+    struct search search;
+    struct pattern* pattern = NULL;
+    size_t npatterns = 0;
+    size_t stride[MAXVARIANTS];
+    size_t nstrides = 0;
+    int scale[MAXVARIANTS];
+    size_t nscales = 0;
+    int le16 = 0;
+    int be16 = 0;
+    int returncode = 0;
     int i;
+    int firstfile;
+    size_t j, k;
     off_t total = 0;
 
     normalize_argv0(argv[0]);
+    memset(&search, 0, sizeof(search));
 
-    if(argc < 3) {
+    //
+    // Options
+    //
+    for(i = 1; i < argc; i++) {
+        if(!strcmp(argv[i], "-f") && (i + 1) < argc) {
+            patternfile = argv[++i];
+        } else if(
+            (!strcmp(argv[i], "-stride") || !strcmp(argv[i], "-scale")) &&
+            (i + 1) < argc
+        ) {
+            int isstride = !strcmp(argv[i], "-stride");
+            char* end;
+            unsigned long n = strtoul(argv[++i], &end, 0);
+            if(
+                *end || n < 1 || n > (isstride ? MAXSTRIDE : MAXSCALE) ||
+                (isstride ? nstrides : nscales) >= MAXVARIANTS
+            ) {
+                printf("Invalid %s value: %s\n", argv[i - 1], argv[i]);
+                return 1;
+            }
+            if(isstride) {
+                stride[nstrides++] = n;
+            } else {
+                scale[nscales++] = (int)n;
+            }
+        } else if(!strcmp(argv[i], "-le16")) {
+            le16 = 1;
+        } else if(!strcmp(argv[i], "-be16")) {
+            be16 = 1;
+        } else {
+            break;
+        }
+    }
+    firstfile = patternfile ? i : (i + 1);
+    if(firstfile >= argc) {
         banner();
         printf(
-            "Usage: %s string files\n"
+            "Usage: %s [options] string files\n"
+            "       %s [options] -f patternfile files\n"
             "\n"
             "Search string may include '.' characters as wildcards, but must include at\n"
-            "least two non-wildcard characters.\n",
+            "least two non-wildcard characters.\n"
+            "\n"
+            "With -f, every line of patternfile is searched for at once.  Each pattern\n"
+            "must include two non-wildcard characters in a row.\n"
+            "\n"
+            "Options:\n"
+            "  -stride n   Look at every nth byte (default: 1 and 2)\n"
+            "  -scale n    Expect n codes per letter (default: 1 and 2)\n"
+            "  -le16       Also look at 16-bit little-endian values\n"
+            "  -be16       Also look at 16-bit big-endian values\n"
+            "-stride and -scale may be given more than once.\n",
+            argv[0],
             argv[0]
         );
         return 1;
     }
-    string = (const uint8_t*)(argv[1]);
-    {   size_t nwc = 0;
-        const uint8_t* s = string;
-        for(;;) {
-            uint8_t c = *s++;
-            if(!c) { break; }
-            if(c != '.') { nwc++; }
+    //
+    // Every stride with every scale, then 16-bit values with every scale
+    //
+    if(!nstrides) {
+        stride[nstrides++] = 1;
+        stride[nstrides++] = 2;
+    }
+    if(!nscales) {
+        scale[nscales++] = 1;
+        scale[nscales++] = 2;
+    }
+    for(j = 0; j < nstrides; j++) {
+        for(k = 0; k < nscales; k++) {
+            if(variant_add(stride[j], scale[k], 1, 0)) { return 1; }
         }
-        if(nwc < 2) {
-            printf(
-                "Search string must contain at least two non-wildcard characters\n"
-            );
-            return 1;
+    }
+    for(j = 0; j < 2; j++) {
+        if(!(j ? be16 : le16)) { continue; }
+        for(k = 0; k < nscales; k++) {
+            if(variant_add(2, scale[k], 2, (int)j)) { return 1; }
+        }
+    }
+
+    if(patternfile) {
+        if(load_patterns(patternfile, &pattern, &npatterns)) {
+            goto error;
+        }
+        if(search_init_multi(&search, pattern, npatterns)) {
+            goto error;
+        }
+        printf("Searching for %lu pattern%s:\n",
+            (unsigned long)npatterns, npatterns == 1 ? "" : "s"
+        );
+    } else {
+        string = (const uint8_t*)(argv[firstfile - 1]);
+        {   size_t nwc = 0;
+            const uint8_t* s = string;
+            for(;;) {
+                uint8_t c = *s++;
+                if(!c) { break; }
+                if(c != '.') { nwc++; }
+            }
+            if(nwc < 2) {
+                printf(
+                    "Search string must contain at least two non-wildcard characters\n"
+                );
+                return 1;
+            }
         }
+        if(search_init(&search, string)) {
+            goto error;
+        }
+        printf("Searching for \"%s\":\n", string);
     }
-    printf("Searching for \"%s\":\n", string);
-    for(i = 2; i < argc; i++) {
-        total += relsearch(string, argv[i]);
+    //
+    // Read each file ahead while the one before it is searched
+    //
+    search_prefetch(argv[firstfile]);
+    for(i = firstfile; i < argc; i++) {
+        if((i + 1) < argc) {
+            search_prefetch(argv[i + 1]);
+        }
+        total += relsearch(&search, argv[i]);
     }
     printf(
         "Total: %lu %s found\n",
         (unsigned long)total,
         (total == 1) ? "match" : "matches"
     );
-    return 0;
+    goto done;
+
+error:
+    returncode = 1;
+
+done:
+    search_free(&search);
+    free_patterns(pattern, npatterns);
+    return returncode;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
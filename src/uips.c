@@ -28,9 +28,10 @@ static const off_t IPS_LIMIT = 0x01000000L;
 
 //
 // Wrapper for fopen that does various things
+// A NULL mode creates a new file, and fails if it already exists
 //
 static FILE *my_fopen(const char *filename, const char *mode, off_t *size) {
-    FILE *f = fopen(filename, mode);
+    FILE *f = mode ? fopen(filename, mode) : fopennew(filename);
     if(!f) { goto error; }
     if(size) {
         if(fseeko(f, 0, SEEK_END) == -1) { goto error; }
@@ -72,97 +73,504 @@ static void writevalue(int32_t value, FILE *f, size_t nbytes) {
     }
 }
 
+//
+// Buffered reader used when creating patches
+//
+// Scanning is mostly sequential, so each file is read in large blocks and only
+// re-read if we need to back up outside the current block.
+//
+enum { IPSBUF_SIZE = 0x8000 };
+
+struct ipsbuf {
+    FILE*       f;
+    const char* name;
+    off_t       size;
+    off_t       start;   // file offset of data[0]
+    size_t      len;     // number of valid bytes in data
+    off_t       filepos; // current stdio position
+    int         error;
+    uint8_t*    data;
+    off_t       same_start; // for sources: range known to match the target
+    off_t       same_end;
+};
+
+//
+// Returns nonzero on error
+//
+static int ipsbuf_open(struct ipsbuf* b, const char* filename) {
+    memset(b, 0, sizeof(*b));
+    b->name = filename;
+    b->data = malloc(IPSBUF_SIZE);
+    if(!b->data) {
+        printf("Out of memory\n");
+        return 1;
+    }
+    b->f = my_fopen(filename, "rb", &(b->size));
+    if(!b->f) { return 1; }
+    return 0;
+}
+
+static void ipsbuf_close(struct ipsbuf* b) {
+    if(b->f   ) { fclose(b->f   ); b->f    = NULL; }
+    if(b->data) { free  (b->data); b->data = NULL; }
+}
+
+//
+// Make the bytes starting at ofs available in *p
+// Returns the number of bytes available, or 0 at end-of-file or on error
+//
+static size_t ipsbuf_get(struct ipsbuf* b, off_t ofs, const uint8_t** p) {
+    if(ofs < b->start || ofs >= b->start + ((off_t)(b->len))) {
+        size_t want = IPSBUF_SIZE;
+        if(ofs >= b->size || b->error) {
+            return 0;
+        }
+        if(b->size - ofs < ((off_t)want)) {
+            want = (size_t)(b->size - ofs);
+        }
+        if(ofs != b->filepos && fseeko(b->f, ofs, SEEK_SET) != 0) {
+            b->error = 1;
+            return 0;
+        }
+        b->start   = ofs;
+        b->len     = fread(b->data, 1, want, b->f);
+        b->filepos = ofs + ((off_t)(b->len));
+        if(b->len != want) {
+            b->error = 1;
+            return 0;
+        }
+    }
+    *p = b->data + ((size_t)(ofs - b->start));
+    return b->len - ((size_t)(ofs - b->start));
+}
+
+//
+// Get a single byte, or -1 at end-of-file or on error
+//
+static int ipsbuf_byte(struct ipsbuf* b, off_t ofs) {
+    const uint8_t* p;
+    if(!ipsbuf_get(b, ofs, &p)) {
+        return -1;
+    }
+    return *p;
+}
+
+//
+// CRC32, for reporting results and for UPS/BPS checksums
+//
+static uint32_t crctable[256];
+
+static void crc_init(void) {
+    uint32_t i, j, k;
+    for(i = 0; i < 256; i++) {
+        j = i;
+        for(k = 0; k < 8; k++) {
+            j = (j >> 1) ^ ((j & 1) ? 0xEDB88320 : 0);
+        }
+        crctable[i] = j;
+    }
+}
+
+static uint32_t crc_update(uint32_t crc, const uint8_t *src, size_t size) {
+    crc = ~crc;
+    while(size--) {
+        crc = (crc >> 8) ^ crctable[(crc ^ (*src++)) & 0xFF];
+    }
+    return ~crc;
+}
+
+//
+// Compute the CRC32 (and optionally the size) of an entire file
+// Returns 0 on success
+//
+static int get_file_crc(
+    const char *filename,
+    uint32_t   *crc_out,
+    off_t      *size_out
+) {
+    struct ipsbuf b;
+    uint32_t crc = 0;
+    off_t ofs = 0;
+    if(ipsbuf_open(&b, filename)) { goto err; }
+    while(ofs < b.size) {
+        const uint8_t *p;
+        size_t n = ipsbuf_get(&b, ofs, &p);
+        if(!n) {
+            printfileerror(b.f, filename);
+            goto err;
+        }
+        crc = crc_update(crc, p, n);
+        ofs += n;
+    }
+    ipsbuf_close(&b);
+    *crc_out = crc;
+    if(size_out) { *size_out = ofs; }
+    return 0;
+err:
+    ipsbuf_close(&b);
+    return 1;
+}
+
+//
+// Buffered writer used for UPS and BPS output, which keeps a running CRC32 of
+// everything written
+//
+struct outbuf {
+    FILE*       f;
+    const char* name;
+    off_t       pos;   // number of bytes written, including buffered ones
+    size_t      len;   // number of bytes waiting in data
+    uint32_t    crc;   // CRC32 of the bytes already flushed
+    int         error;
+    uint8_t*    data;
+};
+
+//
+// Returns nonzero on error
+//
+static int outbuf_open(
+    struct outbuf* o,
+    const char*    filename,
+    const char*    mode
+) {
+    memset(o, 0, sizeof(*o));
+    o->name = filename;
+    o->data = malloc(IPSBUF_SIZE);
+    if(!o->data) {
+        printf("Out of memory\n");
+        return 1;
+    }
+    o->f = my_fopen(filename, mode, NULL);
+    if(!o->f) { return 1; }
+    return 0;
+}
+
+static void outbuf_flush(struct outbuf* o) {
+    if(o->len && !o->error) {
+        if(fwrite(o->data, 1, o->len, o->f) != o->len) {
+            o->error = 1;
+        }
+        o->crc = crc_update(o->crc, o->data, o->len);
+    }
+    o->len = 0;
+}
+
+static void outbuf_byte(struct outbuf* o, int c) {
+    if(o->len == IPSBUF_SIZE) {
+        outbuf_flush(o);
+    }
+    o->data[o->len++] = (uint8_t)c;
+    o->pos++;
+}
+
+static void outbuf_write(struct outbuf* o, const uint8_t* src, size_t n) {
+    while(n) {
+        size_t k = IPSBUF_SIZE - o->len;
+        if(!k) {
+            outbuf_flush(o);
+            continue;
+        }
+        if(k > n) {
+            k = n;
+        }
+        memcpy(o->data + o->len, src, k);
+        o->len += k;
+        o->pos += k;
+        src    += k;
+        n      -= k;
+    }
+}
+
+//
+// Write a number in the variable-length format used by UPS and BPS
+//
+static void outbuf_varint(struct outbuf* o, off_t value) {
+    for(;;) {
+        int c = (int)(value & 0x7F);
+        value >>= 7;
+        if(!value) {
+            outbuf_byte(o, 0x80 | c);
+            break;
+        }
+        outbuf_byte(o, c);
+        value--;
+    }
+}
+
+//
+// Write a 32-bit number, LSB first
+//
+static void outbuf_le32(struct outbuf* o, uint32_t value) {
+    outbuf_byte(o, (int)((value      ) & 0xFF));
+    outbuf_byte(o, (int)((value >>  8) & 0xFF));
+    outbuf_byte(o, (int)((value >> 16) & 0xFF));
+    outbuf_byte(o, (int)((value >> 24) & 0xFF));
+}
+
+//
+// Copy n bytes of earlier output starting at ofs, which must be before the
+// current position.  The source and destination may overlap.
+// The file must have been opened for update.
+//
+static void outbuf_copy(struct outbuf* o, off_t ofs, off_t n) {
+    while(n > 0 && !o->error) {
+        off_t bufstart = o->pos - ((off_t)(o->len));
+        if(ofs >= bufstart) {
+            //
+            // Still in the buffer; copy a byte at a time in case of overlap
+            //
+            while(n > 0 && o->len < IPSBUF_SIZE) {
+                o->data[o->len++] = o->data[(size_t)(ofs - bufstart)];
+                o->pos++;
+                ofs++;
+                n--;
+            }
+            if(n > 0) {
+                outbuf_flush(o);
+            }
+        } else {
+            //
+            // Already written out; read it back into the (empty) buffer
+            //
+            size_t k = IPSBUF_SIZE;
+            outbuf_flush(o);
+            if(((off_t)k) > n           ) { k = (size_t)n;            }
+            if(((off_t)k) > o->pos - ofs) { k = (size_t)(o->pos - ofs); }
+            if(
+                fseeko(o->f, ofs, SEEK_SET) != 0 ||
+                fread(o->data, 1, k, o->f) != k ||
+                fseeko(o->f, o->pos, SEEK_SET) != 0
+            ) {
+                o->error = 1;
+                break;
+            }
+            o->len  = k;
+            o->pos += k;
+            ofs    += k;
+            n      -= k;
+        }
+    }
+}
+
+//
+// Flush and close the file
+// Returns nonzero on error
+//
+static int outbuf_close(struct outbuf* o) {
+    int returncode = 0;
+    if(o->f) {
+        outbuf_flush(o);
+        if(o->error || fflush(o->f) != 0 || ferror(o->f)) {
+            printfileerror(o->f, o->name);
+            returncode = 1;
+        }
+        fclose(o->f);
+        o->f = NULL;
+    }
+    if(o->data) { free(o->data); o->data = NULL; }
+    return returncode;
+}
+
+//
+// Get as many bytes as are available in the target and every source at ofs
+// The target's bytes are returned in *t
+//
+static size_t get_common_block(
+          off_t      ofs,
+          struct ipsbuf *source,
+          size_t     source_nfiles,
+          struct ipsbuf *target,
+    const uint8_t  **t
+) {
+    size_t i;
+    size_t n = ipsbuf_get(target, ofs, t);
+    for(i = 0; n && i < source_nfiles; i++) {
+        const uint8_t* s;
+        size_t m = ipsbuf_get(source + i, ofs, &s);
+        if(m < n) {
+            n = m;
+        }
+    }
+    return n;
+}
+
+//
+// Count how many bytes at the start of a block match between a source and the
+// target (the caller has already fetched both at ofs)
+//
+// Each source remembers the range it's known to match the target over, so
+// that every source is only compared once no matter how often it's asked.
+//
+static size_t get_source_same(
+          struct ipsbuf *source,
+          off_t          ofs,
+    const uint8_t       *s,
+    const uint8_t       *t,
+          size_t         n
+) {
+    size_t k = 0;
+    if(ofs >= source->same_start && ofs < source->same_end) {
+        if(source->same_end - ofs >= ((off_t)n)) {
+            return n;
+        }
+        k = (size_t)(source->same_end - ofs);
+    }
+    if(memcmp(s + k, t + k, n - k)) {
+        while(s[k] == t[k]) { k++; }
+    } else {
+        k = n;
+    }
+    if(ofs >= source->same_start && ofs <= source->same_end) {
+        if(ofs + ((off_t)k) > source->same_end) {
+            source->same_end = ofs + k;
+        }
+    } else {
+        source->same_start = ofs;
+        source->same_end   = ofs + k;
+    }
+    return k;
+}
+
+//
+// Merge which bytes of a block differ between a source and the target into
+// diff, skipping over any matching prefix
+//
+static void get_source_diff(
+          struct ipsbuf *source,
+          off_t          ofs,
+    const uint8_t       *t,
+          uint8_t       *diff,
+          size_t         n
+) {
+    const uint8_t* s;
+    size_t k;
+    ipsbuf_get(source, ofs, &s);
+    for(k = get_source_same(source, ofs, s, t, n); k < n; k++) {
+        diff[k] |= s[k] ^ t[k];
+    }
+}
+
 //
 // Search for the next difference between the target file and a number of
 // source files
 //
 static off_t get_next_difference(
           off_t      ofs,
-          FILE     **source_file,
-    const off_t     *source_size,
+          struct ipsbuf *source,
           size_t     source_nfiles,
-          FILE      *target_file,
-          off_t      target_size
+          struct ipsbuf *target
 ) {
     size_t i;
-    if(ofs >= target_size) {
-        return target_size;
+    if(ofs >= target->size) {
+        return target->size;
     }
-    fseeko(target_file, ofs, SEEK_SET);
     for(i = 0; i < source_nfiles; i++) {
-        if(ofs >= source_size[i]) {
+        if(ofs >= source[i].size) {
             return ofs;
         }
     }
-    for(i = 0; i < source_nfiles; i++) {
-        fseeko(source_file[i], ofs, SEEK_SET);
-    }
     for(;;) {
-        int tc = fgetc(target_file);
-        if(tc == EOF) {
-            return target_size;
+        const uint8_t* t;
+        size_t n = get_common_block(ofs, source, source_nfiles, target, &t);
+        size_t same = n;
+        if(!n) {
+            //
+            // Either the target ended, or a source did
+            //
+            return (ofs >= target->size) ? target->size : ofs;
         }
+        //
+        // Compare the whole block for every source, so each one remembers
+        // how far it matches
+        //
         for(i = 0; i < source_nfiles; i++) {
-            if(fgetc(source_file[i]) != tc) {
-                return ofs;
+            const uint8_t* s;
+            size_t k;
+            ipsbuf_get(source + i, ofs, &s);
+            k = get_source_same(source + i, ofs, s, t, n);
+            if(k < same) {
+                same = k;
             }
         }
-        ofs++;
+        ofs += same;
+        if(same < n) {
+            return ofs;
+        }
     }
 }
 
 //
 // Search for the end of a difference block
 //
+// diff is scratch space of at least IPSBUF_SIZE bytes
+//
 static off_t get_difference_end(
           off_t      ofs,
           off_t      similar_limit,
-          FILE     **source_file,
-    const off_t     *source_size,
+          struct ipsbuf *source,
           size_t     source_nfiles,
-          FILE      *target_file,
-          off_t      target_size
+          struct ipsbuf *target,
+          uint8_t   *diff
 ) {
     size_t i;
     off_t similar_rl = 0;
-    if(ofs >= target_size) {
-        return target_size;
+    if(ofs >= target->size) {
+        return target->size;
     }
-    fseeko(target_file, ofs, SEEK_SET);
     for(i = 0; i < source_nfiles; i++) {
-        if(ofs >= source_size[i]) {
-            return target_size;
+        if(ofs >= source[i].size) {
+            return target->size;
         }
     }
-    for(i = 0; i < source_nfiles; i++) {
-        fseeko(source_file[i], ofs, SEEK_SET);
-    }
     for(;;) {
-        char is_different = 0;
-        int tc = fgetc(target_file);
-        if(tc == EOF) {
-            return target_size;
+        const uint8_t* t;
+        size_t n = get_common_block(ofs, source, source_nfiles, target, &t);
+        size_t k;
+        if(!n) {
+            return target->size;
         }
+        //
+        // Figure out which bytes differ in any source
+        //
+        memset(diff, 0, n);
         for(i = 0; i < source_nfiles; i++) {
-            int fc = fgetc(source_file[i]);
-            if(fc == EOF) {
-                return target_size;
-            }
-            if(fc != tc) {
-                is_different = 1;
-            }
+            get_source_diff(source + i, ofs, t, diff, n);
         }
-        ofs++;
-        if(is_different) {
-            similar_rl = 0;
-        } else {
-            similar_rl++;
-            if(similar_rl == similar_limit) {
-                break;
+        for(k = 0; k < n; k++) {
+            ofs++;
+            if(diff[k]) {
+                similar_rl = 0;
+            } else {
+                similar_rl++;
+                if(similar_rl == similar_limit) {
+                    return ofs - similar_limit;
+                }
             }
         }
     }
-    return ofs - similar_limit;
+}
+
+//
+// Write a literal block of target data to the patch file
+//
+static void write_target_data(
+    FILE* patch_file,
+    struct ipsbuf* target,
+    off_t ofs,
+    off_t ofs_end
+) {
+    while(ofs < ofs_end) {
+        const uint8_t* t;
+        size_t n = ipsbuf_get(target, ofs, &t);
+        if(!n) {
+            break;
+        }
+        if(((off_t)n) > ofs_end - ofs) {
+            n = (size_t)(ofs_end - ofs);
+        }
+        fwrite(t, 1, n, patch_file);
+        ofs += n;
+    }
 }
 
 //
@@ -170,7 +578,7 @@ static off_t get_difference_end(
 //
 static void encode_patch_block(
     FILE* patch_file,
-    FILE* target_file,
+    struct ipsbuf* target,
     off_t ofs,
     off_t ofs_end
 ) {
@@ -188,14 +596,13 @@ static void encode_patch_block(
         // Write the offset to the patch file
         //
         writevalue(ofs, patch_file, 3);
-        fseeko(target_file, ofs, SEEK_SET);
         //
         // If there is a beginning run of at least 9 bytes, use it
         //
-        c = fgetc(target_file);
+        c = ipsbuf_byte(target, ofs);
         rl = 1;
         while(
-            (fgetc(target_file) == c) &&
+            (ipsbuf_byte(target, ofs + rl) == c) &&
             (rl < 0xFFFF) &&
             ((ofs + rl) < ofs_end)
         ) {
@@ -217,14 +624,13 @@ static void encode_patch_block(
         // run of at least 9, or the block length == 0xFFFF, or the block reaches
         // ofs_end.
         //
-        fseeko(target_file, ofs, SEEK_SET);
         ofs_block_end = ofs;
         c = -1;
         while(
             (ofs_block_end < ofs_end) &&
             ((ofs_block_end - ofs) < 0xFFFF)
         ) {
-            int c2 = fgetc(target_file);
+            int c2 = ipsbuf_byte(target, ofs_block_end);
             ofs_block_end++;
             if(c == c2) {
                 rl++;
@@ -250,14 +656,976 @@ static void encode_patch_block(
         // Encode a regular patch block
         //
         writevalue(ofs_block_end - ofs, patch_file, 2);
-        fseeko(target_file, ofs, SEEK_SET);
-        while(ofs < ofs_block_end) {
-            fputc(fgetc(target_file), patch_file);
+        write_target_data(patch_file, target, ofs, ofs_block_end);
+        ofs = ofs_block_end;
+    }
+}
+
+//
+// Get a block of target data at ofs, along with a flag for each byte saying
+// whether any source differs there (bytes past the end of a source always do)
+//
+// diff is scratch space of at least IPSBUF_SIZE bytes
+// Returns the number of bytes available, or 0 at the end of the target
+//
+static size_t get_difference_block(
+          off_t      ofs,
+          struct ipsbuf *source,
+          size_t     source_nfiles,
+          struct ipsbuf *target,
+    const uint8_t  **t,
+          uint8_t   *diff
+) {
+    size_t i;
+    size_t n;
+    for(i = 0; i < source_nfiles; i++) {
+        if(ofs >= source[i].size) {
+            n = ipsbuf_get(target, ofs, t);
+            memset(diff, 1, n);
+            return n;
+        }
+    }
+    n = get_common_block(ofs, source, source_nfiles, target, t);
+    memset(diff, 0, n);
+    for(i = 0; i < source_nfiles; i++) {
+        get_source_diff(source + i, ofs, *t, diff, n);
+    }
+    return n;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Optimal encoder
+//
+// For a region of the target, find the smallest sequence of records that
+// covers every differing byte.  cost(j) is the smallest patch size covering
+// the differences before position j, and is the least of:
+//
+//   cost(j-1)                        if byte j-1 doesn't differ
+//   cost(i) + 5 + (j - i)            literal record [i, j), j - i <= 0xFFFF
+//   cost(i) + 8                      run record [i, j) of a single byte value
+//
+// where no record may start at IPS_EOF (it would read as the end marker).
+// Both minimums over i are taken from sliding windows with monotonic queues,
+// so the whole thing is linear in the region size.
+//
+// Regions are split where there's a gap of at least 6 identical bytes that no
+// record could usefully span: bridging it with a literal would cost more than
+// a new record header, and a run can't bridge it unless it's all the same byte
+// as the one before.
+//
+enum {
+    DP_SKIP    = 0,
+    DP_LITERAL = 1,
+    DP_RUN     = 2
+};
+
+enum { DP_WINDOW = 0x10000 }; // must be a power of two above 0xFFFF
+
+static const uint32_t DP_INFINITY = 0xFFFFFFFFLU;
+
+struct ipsdp {
+    off_t     start;    // target offset of the region
+    uint32_t  n;        // number of positions seen
+    uint32_t *cost;     // DP_WINDOW most recent costs
+    uint32_t *litq;     // queue of literal start candidates
+    uint32_t *runq;     // queue of run start candidates
+    uint32_t  lit_head, lit_tail;
+    uint32_t  run_head, run_tail;
+    int       lastbyte;
+    uint16_t *len;      // for each position, length of the last record
+    uint8_t  *type;     // for each position, how it was reached
+    uint32_t  size;     // capacity of len and type, grown as regions need it
+    uint32_t  maxlen;   // longest region allowed
+};
+
+static void dp_free(struct ipsdp *dp) {
+    if(dp->cost) { free(dp->cost); dp->cost = NULL; }
+    if(dp->litq) { free(dp->litq); dp->litq = NULL; }
+    if(dp->runq) { free(dp->runq); dp->runq = NULL; }
+    if(dp->len ) { free(dp->len ); dp->len  = NULL; }
+    if(dp->type) { free(dp->type); dp->type = NULL; }
+}
+
+//
+// Allocate the windows, and per-position arrays for a modest region
+// Regions may be up to maxlen bytes; dp_grow makes room as they get longer
+// Returns nonzero if there isn't enough memory
+//
+enum { DP_INITIAL = 0x1000 };
+
+static int dp_init(struct ipsdp *dp, off_t maxlen) {
+    size_t window = DP_WINDOW;
+    size_t count  = DP_INITIAL;
+    memset(dp, 0, sizeof(*dp));
+    if(window > (((size_t)(-1)) / sizeof(*(dp->cost)))) {
+        return 1;
+    }
+    dp->cost = malloc(window * sizeof(*(dp->cost)));
+    dp->litq = malloc(window * sizeof(*(dp->litq)));
+    dp->runq = malloc(window * sizeof(*(dp->runq)));
+    dp->len  = malloc(count  * sizeof(*(dp->len )));
+    dp->type = malloc(count  * sizeof(*(dp->type)));
+    if(!dp->cost || !dp->litq || !dp->runq || !dp->len || !dp->type) {
+        dp_free(dp);
+        return 1;
+    }
+    dp->size   = (uint32_t)count;
+    dp->maxlen = (uint32_t)maxlen;
+    return 0;
+}
+
+//
+// Double the per-position arrays, up to what the longest region needs
+// Returns nonzero if there isn't enough memory
+//
+static int dp_grow(struct ipsdp *dp) {
+    uint32_t  newsize = dp->size * 2;
+    size_t    count;
+    uint16_t *newlen;
+    uint8_t  *newtype;
+    if(newsize < dp->size || newsize > dp->maxlen + 1) {
+        newsize = dp->maxlen + 1;
+    }
+    count = (size_t)newsize;
+    if(
+        ((uint32_t)count) != newsize ||
+        count > (((size_t)(-1)) / sizeof(*(dp->len)))
+    ) {
+        return 1;
+    }
+    newlen = realloc(dp->len, count * sizeof(*(dp->len)));
+    if(!newlen) { return 1; }
+    dp->len = newlen;
+    newtype = realloc(dp->type, count * sizeof(*(dp->type)));
+    if(!newtype) { return 1; }
+    dp->type = newtype;
+    dp->size = newsize;
+    return 0;
+}
+
+static void dp_begin(struct ipsdp *dp, off_t start) {
+    dp->start    = start;
+    dp->n        = 0;
+    dp->cost[0]  = 0;
+    dp->lit_head = dp->lit_tail = 0;
+    dp->run_head = dp->run_tail = 0;
+    dp->lastbyte = -1;
+}
+
+#define DP_COST(i) (dp->cost[(i) & (DP_WINDOW - 1)])
+#define DP_Q(q, i) (dp->q[(i) & (DP_WINDOW - 1)])
+
+//
+// Feed one target byte, and whether it differs, into the region
+// Returns DP_INFINITY if no record can reach it
+//
+static uint32_t dp_step(struct ipsdp *dp, int c, int differs) {
+    uint32_t j      = dp->n;
+    off_t    pos    = dp->start + ((off_t)j);
+    uint32_t here   = DP_COST(j);
+    uint32_t oldest = (j + 1 > 0xFFFF) ? (j + 1 - 0xFFFF) : 0;
+    uint32_t best   = DP_INFINITY;
+    uint8_t  type   = DP_SKIP;
+    uint16_t len    = 1;
+    //
+    // A run can only start within the current run of equal bytes
+    //
+    if(c != dp->lastbyte) {
+        dp->run_head = dp->run_tail;
+    }
+    dp->lastbyte = c;
+    //
+    // Retire candidates that are too far back for a 0xFFFF-byte record
+    //
+    while(dp->lit_head != dp->lit_tail && DP_Q(litq, dp->lit_head) < oldest) {
+        dp->lit_head++;
+    }
+    while(dp->run_head != dp->run_tail && DP_Q(runq, dp->run_head) < oldest) {
+        dp->run_head++;
+    }
+    //
+    // Position j is a candidate for starting a record
+    //
+    if(here != DP_INFINITY && pos != IPS_EOF && pos < IPS_LIMIT) {
+        while(dp->lit_head != dp->lit_tail) {
+            uint32_t back = DP_Q(litq, dp->lit_tail - 1);
+            if(DP_COST(back) + j < here + back) { break; }
+            dp->lit_tail--;
+        }
+        DP_Q(litq, dp->lit_tail++) = j;
+        while(dp->run_head != dp->run_tail) {
+            uint32_t back = DP_Q(runq, dp->run_tail - 1);
+            if(DP_COST(back) < here) { break; }
+            dp->run_tail--;
+        }
+        DP_Q(runq, dp->run_tail++) = j;
+    }
+    //
+    // Find the cheapest way to reach j + 1
+    //
+    if(!differs) {
+        best = here;
+    }
+    if(dp->lit_head != dp->lit_tail) {
+        uint32_t i = DP_Q(litq, dp->lit_head);
+        uint32_t v = DP_COST(i) + 5 + (j + 1 - i);
+        if(v < best) { best = v; type = DP_LITERAL; len = (uint16_t)(j + 1 - i); }
+    }
+    if(dp->run_head != dp->run_tail) {
+        uint32_t i = DP_Q(runq, dp->run_head);
+        uint32_t v = DP_COST(i) + 8;
+        if(v < best) { best = v; type = DP_RUN; len = (uint16_t)(j + 1 - i); }
+    }
+    if(best == DP_INFINITY) {
+        return best;
+    }
+    DP_COST(j + 1)  = best;
+    dp->len [j + 1] = len;
+    dp->type[j + 1] = type;
+    dp->n = j + 1;
+    return best;
+}
+
+#undef DP_COST
+#undef DP_Q
+
+//
+// Write out the records covering the first n positions of the region
+// Returns nonzero if there isn't enough memory
+//
+static int dp_encode(
+    struct ipsdp *dp,
+    uint32_t n,
+    FILE* patch_file,
+    struct ipsbuf* target
+) {
+    uint32_t  j;
+    size_t    count = 0;
+    size_t    k;
+    uint32_t *ends;
+    //
+    // Walk back from the end to count the records, then again to note where
+    // each one ends, so they can be written in forward order
+    //
+    for(j = n; j > 0; j -= (dp->type[j] == DP_SKIP) ? 1 : dp->len[j]) {
+        if(dp->type[j] != DP_SKIP) { count++; }
+    }
+    if(!count) {
+        return 0;
+    }
+    if(count > (((size_t)(-1)) / sizeof(*ends))) {
+        return 1;
+    }
+    ends = malloc(count * sizeof(*ends));
+    if(!ends) {
+        return 1;
+    }
+    k = count;
+    for(j = n; j > 0; j -= (dp->type[j] == DP_SKIP) ? 1 : dp->len[j]) {
+        if(dp->type[j] != DP_SKIP) { ends[--k] = j; }
+    }
+    for(k = 0; k < count; k++) {
+        uint16_t len = dp->len[ends[k]];
+        off_t    ofs = dp->start + ((off_t)(ends[k] - len));
+        writevalue(ofs, patch_file, 3);
+        if(dp->type[ends[k]] == DP_RUN) {
+            writevalue(  0, patch_file, 2);
+            writevalue(len, patch_file, 2);
+            writevalue(ipsbuf_byte(target, ofs), patch_file, 1);
+        } else {
+            writevalue(len, patch_file, 2);
+            write_target_data(patch_file, target, ofs, ofs + len);
+        }
+    }
+    free(ends);
+    return 0;
+}
+
+//
+// Encode the region starting at the difference at ofs
+// Returns the offset where scanning stopped, or -1 if out of memory
+//
+static off_t encode_region(
+    struct ipsdp  *dp,
+    off_t          ofs,
+    struct ipsbuf *source,
+    size_t         source_nfiles,
+    struct ipsbuf *target,
+    uint8_t       *diff,
+    FILE          *patch_file
+) {
+    off_t pos      = ofs;
+    off_t end      = ofs + 1; // one past the last differing byte
+    off_t gap      = 0;       // identical bytes since then
+    int   uniform  = 0;       // whether they're all the same as that byte
+    int   lastdiff = -1;
+    int   prev     = -1;
+    int   done     = 0;
+    //
+    // A record can't start at IPS_EOF, so begin one byte early if needed
+    //
+    if(pos == IPS_EOF) {
+        pos--;
+    }
+    dp_begin(dp, pos);
+    while(!done) {
+        const uint8_t* t;
+        size_t k;
+        size_t n = get_difference_block(
+            pos, source, source_nfiles, target, &t, diff
+        );
+        if(!n) {
+            break;
+        }
+        for(k = 0; k < n; k++) {
+            int c = t[k];
+            if(diff[k]) {
+                end      = pos + ((off_t)k) + 1;
+                gap      = 0;
+                lastdiff = c;
+            } else {
+                uniform = gap ? (uniform && c == prev) : (c == lastdiff);
+                gap++;
+                if(gap >= 6 && (!uniform || gap > 0xFFFF)) {
+                    done = 1;
+                    k++;
+                    break;
+                }
+            }
+            if(dp->n + 1 >= dp->size && dp->n < dp->maxlen && dp_grow(dp)) {
+                return -1;
+            }
+            //
+            // Past IPS_LIMIT, stop at the first byte no record can reach
+            //
+            if(dp->n >= dp->maxlen || dp_step(dp, c, diff[k]) == DP_INFINITY) {
+                if(diff[k]) {
+                    end = pos + ((off_t)k);
+                }
+                done = 1;
+                break;
+            }
+            prev = c;
+        }
+        pos += k;
+    }
+    if(dp_encode(dp, (uint32_t)(end - dp->start), patch_file, target)) {
+        return -1;
+    }
+    return pos;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// UPS and BPS
+//
+// Both formats store the source and target sizes up front, and a footer with
+// the CRC32 of the source, the target, and the patch itself.  Neither has an
+// offset limit, and both take exactly one source file.
+//
+// A UPS patch is a list of (skip count, XOR data) pairs.  A BPS patch is a list
+// of actions that build the target front to back from the source at the same
+// offset, literal data, elsewhere in the source, or earlier in the target.
+//
+enum { PATCH_IPS, PATCH_UPS, PATCH_BPS };
+
+enum {
+    BPS_SOURCE_READ = 0,
+    BPS_TARGET_READ = 1,
+    BPS_SOURCE_COPY = 2,
+    BPS_TARGET_COPY = 3
+};
+
+//
+// Shortest matches worth breaking up literal data for
+//
+enum { BPS_MIN_READ = 4, BPS_MIN_COPY = 8 };
+
+//
+// Longest single action; keeps the encoded length within an off_t
+//
+static const off_t BPS_MAX_ACTION = ((off_t)1) << (8 * sizeof(off_t) - 4);
+
+//
+// Pick a patch format based on the filename extension
+//
+static int get_patch_format(const char* filename) {
+    const char* ext = strrchr(filename, '.');
+    char lower[4];
+    size_t i;
+    if(!ext || strlen(ext) != 4) {
+        return PATCH_IPS;
+    }
+    for(i = 0; i < 3; i++) {
+        lower[i] = (char)tolower((uint8_t)ext[i + 1]);
+    }
+    lower[3] = 0;
+    if(!strcmp(lower, "ups")) { return PATCH_UPS; }
+    if(!strcmp(lower, "bps")) { return PATCH_BPS; }
+    return PATCH_IPS;
+}
+
+//
+// Like ipsbuf_get, but past the end of the file, supply a block of zeroes
+//
+static size_t ipsbuf_get_padded(
+    struct ipsbuf*  b,
+    off_t           ofs,
+    const uint8_t** p,
+    const uint8_t*  zero
+) {
+    if(ofs >= b->size) {
+        *p = zero;
+        return IPSBUF_SIZE;
+    }
+    return ipsbuf_get(b, ofs, p);
+}
+
+//
+// Create a UPS patch
+// Returns 0 on success
+//
+static int ups_create(
+    const char    *patch_filename,
+    struct ipsbuf *source,
+    struct ipsbuf *target
+) {
+    int           returncode = 0;
+    struct outbuf out;
+    uint8_t      *zero = NULL;
+    off_t         size = (source->size > target->size) ?
+                         source->size : target->size;
+    off_t         ofs;
+    off_t         last = 0;
+    int           in_block = 0;
+    uint32_t      source_crc = 0;
+    uint32_t      target_crc = 0;
+
+    memset(&out, 0, sizeof(out));
+    zero = calloc(1, IPSBUF_SIZE);
+    if(!zero) {
+        printf("Out of memory\n");
+        goto err;
+    }
+    if(outbuf_open(&out, patch_filename, "wb")) { goto err; }
+
+    outbuf_write(&out, (const uint8_t*)"UPS1", 4);
+    outbuf_varint(&out, source->size);
+    outbuf_varint(&out, target->size);
+    //
+    // Each block is the number of identical bytes to skip, then the XOR of
+    // the differing bytes, ended by a zero.  The zero itself stands for one
+    // more identical byte.  Bytes past the end of either file count as zero.
+    //
+    for(ofs = 0; ofs < size;) {
+        const uint8_t *s, *t;
+        size_t k;
+        size_t n = ipsbuf_get_padded(source, ofs, &s, zero);
+        size_t m = ipsbuf_get_padded(target, ofs, &t, zero);
+        if(!n || !m) {
+            break;
+        }
+        if(m < n) { n = m; }
+        if(((off_t)n) > size - ofs) { n = (size_t)(size - ofs); }
+        if(ofs < source->size) { source_crc = crc_update(source_crc, s, n); }
+        if(ofs < target->size) { target_crc = crc_update(target_crc, t, n); }
+        if(in_block || memcmp(s, t, n)) {
+            for(k = 0; k < n; k++) {
+                int x = s[k] ^ t[k];
+                if(in_block) {
+                    outbuf_byte(&out, x);
+                    if(!x) {
+                        in_block = 0;
+                        last = ofs + k + 1;
+                    }
+                } else if(x) {
+                    outbuf_varint(&out, ofs + k - last);
+                    outbuf_byte(&out, x);
+                    in_block = 1;
+                }
+            }
+        }
+        ofs += n;
+    }
+    if(in_block) {
+        outbuf_byte(&out, 0);
+    }
+    if(source->error) {
+        printfileerror(source->f, source->name);
+        goto err;
+    }
+    if(target->error) {
+        printfileerror(target->f, target->name);
+        goto err;
+    }
+    outbuf_le32(&out, source_crc);
+    outbuf_le32(&out, target_crc);
+    outbuf_flush(&out);
+    outbuf_le32(&out, out.crc);
+    goto no_err;
+
+err:
+    returncode = 1;
+no_err:
+    if(outbuf_close(&out)) { returncode = 1; }
+    if(zero) { free(zero); }
+    return returncode;
+}
+
+//
+// BPS encoder state
+//
+// Moved data is found with an index of rolling hashes of source blocks.  The
+// index has a bounded number of entries, so larger sources just use larger
+// blocks.  Every target offset is hashed and looked up in the index.
+//
+// Most lookups miss, so a bit filter four times the size of the index, which
+// is small enough to stay in cache, is checked first.
+//
+struct bpsentry {
+    off_t    ofs;   // source offset of the block, or -1 if empty
+    uint32_t hash;
+};
+
+struct bpsenc {
+    struct outbuf    out;
+    struct ipsbuf   *source;     // source, compared at the target offset
+    struct ipsbuf   *target;     // target, read at the scan position
+    struct ipsbuf    copy;       // source, compared at index matches
+    struct ipsbuf    track;      // source, compared at the last copy's delta
+    struct ipsbuf    lit;        // target, read once start to finish
+    struct bpsentry *index;
+    uint8_t         *filter;
+    uint32_t         index_bits;
+    size_t           block;      // length of each hashed block
+    uint32_t         power;      // HASH_MUL^(block-1)
+    off_t            hash_ofs;   // where hash was computed, or -1
+    uint32_t         hash;
+    off_t            source_rel; // decoder's source copy position
+    off_t            target_rel; // decoder's target copy position
+    off_t            delta;      // source - target offset of the last copy
+    uint32_t         target_crc;
+};
+
+static const uint32_t HASH_MUL = 0x01000193LU;
+
+static size_t bps_index_slot(const struct bpsenc* enc, uint32_t hash) {
+    hash *= 0x9E3779B1LU;
+    return (size_t)((hash & 0xFFFFFFFFLU) >> (32 - enc->index_bits));
+}
+
+static size_t bps_filter_bit(const struct bpsenc* enc, uint32_t hash) {
+    hash *= 0x85EBCA6BLU;
+    return (size_t)((hash & 0xFFFFFFFFLU) >> (30 - enc->index_bits));
+}
+
+//
+// Hash every block-aligned source block into the index, and compute the
+// source CRC along the way
+// Returns nonzero on a read error
+//
+static int bps_index_source(struct bpsenc* enc, uint32_t* source_crc) {
+    struct ipsbuf* source = enc->source;
+    uint32_t crc = 0;
+    uint32_t hash = 0;
+    off_t ofs = 0;
+    size_t i;
+    if(enc->index) {
+        for(i = 0; i < (((size_t)1) << enc->index_bits); i++) {
+            enc->index[i].ofs = -1;
+        }
+        memset(enc->filter, 0, ((size_t)1) << (enc->index_bits - 1));
+    }
+    while(ofs < source->size) {
+        const uint8_t* s;
+        size_t k;
+        size_t n = ipsbuf_get(source, ofs, &s);
+        if(!n) {
+            return 1;
+        }
+        crc = crc_update(crc, s, n);
+        if(enc->index) {
+            for(k = 0; k < n; k++) {
+                hash = hash * HASH_MUL + s[k];
+                if(((size_t)(ofs + k + 1)) % enc->block == 0) {
+                    struct bpsentry* e = enc->index + bps_index_slot(enc, hash);
+                    if(e->ofs < 0) {
+                        size_t bit = bps_filter_bit(enc, hash);
+                        e->ofs  = ofs + k + 1 - enc->block;
+                        e->hash = hash;
+                        enc->filter[bit >> 3] |= 1 << (bit & 7);
+                    }
+                    hash = 0;
+                }
+            }
+        }
+        ofs += n;
+    }
+    *source_crc = crc;
+    return 0;
+}
+
+//
+// Get the rolling hash of the target block at ofs
+//
+static uint32_t bps_target_hash(struct bpsenc* enc, off_t ofs) {
+    off_t block = (off_t)(enc->block);
+    if(
+        enc->hash_ofs < 0 ||
+        ofs < enc->hash_ofs ||
+        ofs - enc->hash_ofs >= block
+    ) {
+        off_t i;
+        enc->hash = 0;
+        for(i = 0; i < block; i++) {
+            enc->hash = enc->hash * HASH_MUL +
+                (uint8_t)ipsbuf_byte(enc->target, ofs + i);
+        }
+    } else {
+        for(; enc->hash_ofs < ofs; enc->hash_ofs++) {
+            off_t    i   = enc->hash_ofs;
+            uint32_t out = (uint8_t)ipsbuf_byte(enc->target, i);
+            uint32_t in  = (uint8_t)ipsbuf_byte(enc->target, i + block);
+            enc->hash = (enc->hash - out * enc->power) * HASH_MUL + in;
+        }
+    }
+    enc->hash_ofs = ofs;
+    return enc->hash;
+}
+
+//
+// Count how many bytes match between a and b, up to limit
+//
+static off_t match_length(
+    struct ipsbuf* a, off_t aofs,
+    struct ipsbuf* b, off_t bofs,
+    off_t limit
+) {
+    off_t len = 0;
+    while(len < limit) {
+        const uint8_t* p = NULL;
+        const uint8_t* q = NULL;
+        size_t k = 0;
+        size_t n = ipsbuf_get(a, aofs + len, &p);
+        size_t m = ipsbuf_get(b, bofs + len, &q);
+        if(m < n) { n = m; }
+        if(((off_t)n) > limit - len) { n = (size_t)(limit - len); }
+        if(!n) {
+            break;
+        }
+        if(memcmp(p, q, n)) {
+            while(p[k] == q[k]) { k++; }
+            return len + k;
+        }
+        len += n;
+    }
+    return len;
+}
+
+//
+// Count how many bytes starting at ofs equal c, up to limit
+//
+static off_t run_length(struct ipsbuf* b, off_t ofs, int c, off_t limit) {
+    off_t len = 0;
+    while(len < limit) {
+        const uint8_t* p;
+        size_t k;
+        size_t n = ipsbuf_get(b, ofs + len, &p);
+        if(((off_t)n) > limit - len) { n = (size_t)(limit - len); }
+        if(!n) {
+            break;
+        }
+        for(k = 0; k < n && p[k] == c; k++) { }
+        len += k;
+        if(k < n) {
+            break;
+        }
+    }
+    return len;
+}
+
+//
+// Extend a source copy backwards into the pending literal data, by at most
+// 256 bytes
+// Returns how far it was extended
+//
+static off_t bps_extend_back(
+    struct bpsenc* enc,
+    off_t          from,
+    off_t          ofs,
+    off_t          literal
+) {
+    uint8_t s[256], t[256];
+    off_t n = sizeof(s);
+    off_t i;
+    if(n > ofs - literal) { n = ofs - literal; }
+    if(n > from         ) { n = from;          }
+    for(i = 0; i < n; i++) {
+        int a = ipsbuf_byte(&(enc->copy), from - n + i);
+        int b = ipsbuf_byte(enc->target,  ofs  - n + i);
+        if(a < 0 || b < 0) {
+            return 0;
+        }
+        s[i] = (uint8_t)a;
+        t[i] = (uint8_t)b;
+    }
+    for(i = 0; i < n && s[n - 1 - i] == t[n - 1 - i]; i++) { }
+    return i;
+}
+
+//
+// Pass target data from ofs to end through the CRC, and also into the patch
+// as literal data if requested
+//
+static void bps_target_data(
+    struct bpsenc* enc,
+    off_t          ofs,
+    off_t          end,
+    int            literal
+) {
+    while(ofs < end) {
+        const uint8_t* t;
+        size_t n = ipsbuf_get(&(enc->lit), ofs, &t);
+        if(!n) {
+            break;
+        }
+        if(((off_t)n) > end - ofs) {
+            n = (size_t)(end - ofs);
+        }
+        enc->target_crc = crc_update(enc->target_crc, t, n);
+        if(literal) {
+            outbuf_write(&(enc->out), t, n);
+        }
+        ofs += n;
+    }
+}
+
+static void bps_literal(struct bpsenc* enc, off_t ofs, off_t end) {
+    while(ofs < end) {
+        off_t n = end - ofs;
+        if(n > BPS_MAX_ACTION) {
+            n = BPS_MAX_ACTION;
+        }
+        outbuf_varint(&(enc->out), ((n - 1) << 2) | BPS_TARGET_READ);
+        bps_target_data(enc, ofs, ofs + n, 1);
+        ofs += n;
+    }
+}
+
+//
+// Write a relative offset for a copy action, and update the position
+//
+static void bps_relative(
+    struct bpsenc* enc,
+    off_t*         rel,
+    off_t          from,
+    off_t          len
+) {
+    off_t d = from - *rel;
+    outbuf_varint(&(enc->out), (d < 0) ? (((-d) << 1) | 1) : (d << 1));
+    *rel = from + len;
+}
+
+//
+// Create a BPS patch
+// Returns 0 on success
+//
+static int bps_create(
+    const char    *patch_filename,
+    struct ipsbuf *source,
+    struct ipsbuf *target
+) {
+    int           returncode = 0;
+    struct bpsenc enc;
+    off_t         ofs;
+    off_t         literal = 0;
+    size_t        entries;
+    uint32_t      source_crc = 0;
+
+    memset(&enc, 0, sizeof(enc));
+    enc.source   = source;
+    enc.target   = target;
+    enc.hash_ofs = -1;
+    if(
+        ipsbuf_open(&(enc.copy ), source->name) ||
+        ipsbuf_open(&(enc.track), source->name) ||
+        ipsbuf_open(&(enc.lit  ), target->name)
+    ) {
+        goto err;
+    }
+    //
+    // Size the index, using bigger blocks for bigger sources, and falling
+    // back to smaller indexes (or none) if memory is short
+    //
+    entries = (sizeof(size_t) > 2) ? 0x100000L : 0x1000;
+    enc.block = 16;
+    while(
+        enc.block < IPSBUF_SIZE &&
+        (source->size / ((off_t)(enc.block))) > ((off_t)entries)
+    ) {
+        enc.block <<= 1;
+    }
+    while(
+        entries > 0x100 &&
+        ((off_t)(entries / 2)) >= (source->size / ((off_t)(enc.block)))
+    ) {
+        entries >>= 1;
+    }
+    for(; entries >= 0x100; entries >>= 1) {
+        enc.index  = malloc(entries * sizeof(*(enc.index)));
+        enc.filter = malloc(entries / 2);
+        if(enc.index && enc.filter) {
+            break;
+        }
+        if(enc.index ) { free(enc.index ); enc.index  = NULL; }
+        if(enc.filter) { free(enc.filter); enc.filter = NULL; }
+    }
+    if(enc.index) {
+        size_t i;
+        for(enc.index_bits = 0; (((size_t)1) << enc.index_bits) < entries;) {
+            enc.index_bits++;
+        }
+        enc.power = 1;
+        for(i = 1; i < enc.block; i++) {
+            enc.power *= HASH_MUL;
+        }
+    }
+    if(bps_index_source(&enc, &source_crc)) {
+        printfileerror(source->f, source->name);
+        goto err;
+    }
+
+    if(outbuf_open(&(enc.out), patch_filename, "wb")) { goto err; }
+    outbuf_write(&(enc.out), (const uint8_t*)"BPS1", 4);
+    outbuf_varint(&(enc.out), source->size);
+    outbuf_varint(&(enc.out), target->size);
+    outbuf_varint(&(enc.out), 0); // no metadata
+    //
+    // At each target offset, take the longest of:
+    // - the source at the same offset
+    // - the source at the same delta as the last copy
+    // - the source block found in the index
+    // - a run of the previous target byte
+    // or failing all those, leave the byte for a literal.
+    //
+    for(ofs = 0; ofs < target->size;) {
+        off_t limit = target->size - ofs;
+        off_t best  = 0;
+        off_t from  = 0;
+        off_t len;
+        int   type  = BPS_SOURCE_READ;
+        if(limit > BPS_MAX_ACTION) {
+            limit = BPS_MAX_ACTION;
+        }
+        if(ofs < source->size) {
+            len = match_length(source, ofs, target, ofs,
+                (limit < source->size - ofs) ? limit : source->size - ofs
+            );
+            if(len >= BPS_MIN_READ) {
+                best = len;
+            }
+        }
+        if(best < limit) {
+            off_t s = ofs + enc.delta;
+            if(enc.delta && s >= 0 && s < source->size) {
+                len = match_length(&(enc.track), s, target, ofs,
+                    (limit < source->size - s) ? limit : source->size - s
+                );
+                if(len >= BPS_MIN_COPY && len > best) {
+                    best = len;
+                    from = s;
+                    type = BPS_SOURCE_COPY;
+                }
+            }
+        }
+        if(best < limit && enc.index && ((off_t)(enc.block)) <= limit) {
+            uint32_t hash = bps_target_hash(&enc, ofs);
+            size_t   bit  = bps_filter_bit(&enc, hash);
+            const struct bpsentry* e = enc.index + bps_index_slot(&enc, hash);
+            if(
+                (enc.filter[bit >> 3] & (1 << (bit & 7))) &&
+                e->ofs >= 0 && e->hash == hash && e->ofs != ofs
+            ) {
+                len = match_length(&(enc.copy), e->ofs, target, ofs,
+                    (limit < source->size - e->ofs) ?
+                        limit : source->size - e->ofs
+                );
+                if(len >= BPS_MIN_COPY && len > best) {
+                    best = len;
+                    from = e->ofs;
+                    type = BPS_SOURCE_COPY;
+                }
+            }
+        }
+        if(best < limit && ofs > 0) {
+            int c = ipsbuf_byte(target, ofs - 1);
+            len = (c < 0) ? 0 : run_length(target, ofs, c, limit);
+            if(len >= BPS_MIN_COPY && len > best) {
+                best = len;
+                from = ofs - 1;
+                type = BPS_TARGET_COPY;
+            }
+        }
+        if(!best) {
+            if(target->error || source->error) {
+                break;
+            }
             ofs++;
+            continue;
+        }
+        if(type == BPS_SOURCE_COPY) {
+            off_t back = bps_extend_back(&enc, from, ofs, literal);
+            from -= back;
+            ofs  -= back;
+            best += back;
+            enc.delta = from - ofs;
+        }
+        //
+        // Write out any pending literal data, then the action
+        //
+        bps_literal(&enc, literal, ofs);
+        outbuf_varint(&(enc.out), ((best - 1) << 2) | type);
+        if(type == BPS_SOURCE_COPY) {
+            bps_relative(&enc, &(enc.source_rel), from, best);
+        } else if(type == BPS_TARGET_COPY) {
+            bps_relative(&enc, &(enc.target_rel), from, best);
         }
+        bps_target_data(&enc, ofs, ofs + best, 0);
+        ofs += best;
+        literal = ofs;
+    }
+    bps_literal(&enc, literal, target->size);
+    //
+    // Check for read errors that happened along the way
+    //
+    if(target->error || enc.lit.error) {
+        printfileerror(target->f, target->name);
+        goto err;
+    }
+    if(source->error || enc.copy.error || enc.track.error) {
+        printfileerror(source->f, source->name);
+        goto err;
     }
+    outbuf_le32(&(enc.out), source_crc);
+    outbuf_le32(&(enc.out), enc.target_crc);
+    outbuf_flush(&(enc.out));
+    outbuf_le32(&(enc.out), enc.out.crc);
+    goto no_err;
+
+err:
+    returncode = 1;
+no_err:
+    if(outbuf_close(&(enc.out))) { returncode = 1; }
+    ipsbuf_close(&(enc.copy ));
+    ipsbuf_close(&(enc.track));
+    ipsbuf_close(&(enc.lit  ));
+    if(enc.index ) { free(enc.index ); }
+    if(enc.filter) { free(enc.filter); }
+    return returncode;
 }
 
+////////////////////////////////////////////////////////////////////////////////
 //
 // Create a patch given a list of source filenames and a target filename.
 // Returns 0 on success.
@@ -267,45 +1635,72 @@ static int create_patch(
     size_t       source_nfiles,
     const char **source_filename,
     const char  *target_filename
-) {
-    int      returncode = 0;
-    FILE    *patch_file  = NULL;
-    FILE   **source_file = NULL;
-    off_t   *source_size = NULL;
-    FILE    *target_file = NULL;
-    off_t    target_size;
-    off_t    ofs;
-    size_t   i;
-    char     will_truncate = 0;
+) {
+    int            returncode = 0;
+    FILE          *patch_file = NULL;
+    struct ipsbuf *source     = NULL;
+    struct ipsbuf  target;
+    uint8_t       *diff       = NULL;
+    struct ipsdp   dp;
+    int            optimal;
+    int            format = get_patch_format(patch_filename);
+    off_t          ofs;
+    size_t         i;
+    char           will_truncate = 0;
+    memset(&target, 0, sizeof(target));
+    memset(&dp, 0, sizeof(dp));
+    if(format != PATCH_IPS && source_nfiles != 1) {
+        printf("Error: UPS and BPS patches can only have one source file\n");
+        goto err;
+    }
     //
-    // Allocate memory for list of source file streams and sizes
+    // Allocate memory for list of source file buffers, and scratch space
     //
     if(
-        source_nfiles > (((size_t)(-1)) / sizeof(*source_file)) ||
-        source_nfiles > (((size_t)(-1)) / sizeof(*source_size)) ||
-        ((source_file = malloc(sizeof(*source_file) * source_nfiles)) == NULL) ||
-        ((source_size = malloc(sizeof(*source_size) * source_nfiles)) == NULL)
+        source_nfiles > (((size_t)(-1)) / sizeof(*source)) ||
+        ((source = malloc(sizeof(*source) * source_nfiles)) == NULL) ||
+        ((diff = malloc(IPSBUF_SIZE)) == NULL)
     ) {
         printf("Out of memory\n");
         goto err;
     }
-    for(i = 0; i < source_nfiles; i++) { source_file[i] = NULL; }
+    memset(source, 0, sizeof(*source) * source_nfiles);
     //
     // Open target file
     //
-    target_file = my_fopen(target_filename, "rb", &target_size);
-    if(!target_file) { goto err; }
+    if(ipsbuf_open(&target, target_filename)) { goto err; }
     //
     // Open source files
     //
     for(i = 0; i < source_nfiles; i++) {
-        source_file[i] = my_fopen(source_filename[i], "rb", source_size + i);
-        if(!source_file[i]) { goto err; }
-        if(source_size[i] > target_size) {
+        if(ipsbuf_open(source + i, source_filename[i])) { goto err; }
+        if(source[i].size > target.size) {
             will_truncate = 1;
         }
     }
     //
+    // UPS and BPS have their own encoders
+    //
+    if(format != PATCH_IPS) {
+        printf("Creating %s...\n", patch_filename);
+        if(
+            (format == PATCH_UPS) ?
+                ups_create(patch_filename, source, &target) :
+                bps_create(patch_filename, source, &target)
+        ) {
+            goto err;
+        }
+        printf("Done\n");
+        goto no_err;
+    }
+    //
+    // Use the optimal encoder if there's room for it; otherwise fall back on
+    // a simpler greedy one
+    //
+    optimal = !dp_init(&dp,
+        (target.size < IPS_LIMIT + 0xFFFF) ? target.size : IPS_LIMIT + 0xFFFF
+    );
+    //
     // Create patch file
     //
     patch_file = my_fopen(patch_filename, "wb", NULL);
@@ -326,48 +1721,75 @@ static int create_patch(
         //
         ofs = get_next_difference(
             ofs,
-            source_file,
-            source_size,
+            source,
             source_nfiles,
-            target_file,
-            target_size
+            &target
         );
-        if(ofs == target_size) {
+        if(ofs == target.size) {
             break;
         }
         if(ofs >= IPS_LIMIT) {
             printf("Warning: Differences beyond 16MiB were ignored\n");
             break;
         }
+        if(optimal) {
+            ofs = encode_region(
+                &dp,
+                ofs,
+                source,
+                source_nfiles,
+                &target,
+                diff,
+                patch_file
+            );
+            if(ofs < 0) {
+                printf("Out of memory\n");
+                goto err;
+            }
+            continue;
+        }
         //
         // Determine the length of the difference block
         //
         ofs_end = get_difference_end(
             ofs,
             6,
-            source_file,
-            source_size,
+            source,
             source_nfiles,
-            target_file,
-            target_size
+            &target,
+            diff
         );
         //
         // Encode the difference block into the patch file
         //
-        encode_patch_block(patch_file, target_file, ofs, ofs_end);
+        encode_patch_block(patch_file, &target, ofs, ofs_end);
         ofs = ofs_end;
     }
     //
+    // Check for read errors that happened along the way
+    //
+    if(target.error) {
+        printfileerror(target.f, target.name);
+        goto err;
+    }
+    for(i = 0; i < source_nfiles; i++) {
+        if(source[i].error) {
+            printfileerror(source[i].f, source[i].name);
+            goto err;
+        }
+    }
+    //
     // Write EOF marker
     //
     writevalue(IPS_EOF, patch_file, 3);
     if(will_truncate) {
-        if(target_size >= IPS_LIMIT) {
+        if(target.size >= IPS_LIMIT) {
             printf("Warning: Can't truncate beyond 16MiB\n");
         } else {
-            writevalue(target_size, patch_file, 3);
+            writevalue(target.size, patch_file, 3);
         }
     }
+    if(fflush(patch_file) != 0 || ferror(patch_file)) { goto err_patch_file; }
     //
     // Finished
     //
@@ -380,142 +1802,708 @@ err:
     returncode = 1;
 no_err:
     if(patch_file) { fclose(patch_file); }
-    for(i = 0; i < source_nfiles; i++) {
-        if(source_file[i]) { fclose(source_file[i]); }
+    if(source) {
+        for(i = 0; i < source_nfiles; i++) {
+            ipsbuf_close(source + i);
+        }
+        free(source);
     }
-    if(target_file) { fclose(target_file); }
-    if(source_file) { free(source_file); }
-    if(source_size) { free(source_size); }
+    ipsbuf_close(&target);
+    if(diff) { free(diff); }
+    dp_free(&dp);
     return returncode;
 }
 
 //
-// Apply a patch to a given target.
-// Returns 0 on success.
+// A parsed IPS patch
 //
-static int apply_patch(
-    const char* patch_filename,
-    const char* target_filename
-) {
-    int returncode = 0;
-    FILE *patch_file  = NULL;
-    FILE *target_file = NULL;
-    off_t target_size;
-    off_t ofs;
+// Records are kept in file order, since later records may overwrite earlier
+// ones.  Literal data stays in the patch file and is read as needed.
+//
+struct ipsrecord {
+    off_t    ofs;
+    off_t    data;  // offset of literal data in the patch file
+    uint16_t len;   // number of target bytes covered
+    uint8_t  rle;   // nonzero for a run of rchar
+    uint8_t  rchar;
+};
+
+struct ipspatch {
+    const char       *name;
+    FILE             *f;
+    struct ipsrecord *rec;
+    size_t            count;
+    off_t             end;      // highest offset written by any record
+    off_t             truncate; // or -1 if none
+};
+
+static void ips_free(struct ipspatch *patch) {
+    if(patch->f  ) { fclose(patch->f  ); patch->f   = NULL; }
+    if(patch->rec) { free  (patch->rec); patch->rec = NULL; }
+}
+
+//
+// Read and validate an entire IPS patch
+// Returns 0 on success
+//
+static int ips_load(struct ipspatch *patch, const char *patch_filename) {
+    off_t  patch_size;
+    size_t capacity = 0;
+
+    memset(patch, 0, sizeof(*patch));
+    patch->name     = patch_filename;
+    patch->truncate = -1;
     //
     // Open patch file
     //
-    patch_file = my_fopen(patch_filename, "rb", NULL);
-    if(!patch_file) { goto err; }
+    patch->f = my_fopen(patch_filename, "rb", &patch_size);
+    if(!patch->f) { goto err; }
     //
     // Verify first five characters
     //
     if(
-        (fgetc(patch_file) != 'P') ||
-        (fgetc(patch_file) != 'A') ||
-        (fgetc(patch_file) != 'T') ||
-        (fgetc(patch_file) != 'C') ||
-        (fgetc(patch_file) != 'H')
+        (fgetc(patch->f) != 'P') ||
+        (fgetc(patch->f) != 'A') ||
+        (fgetc(patch->f) != 'T') ||
+        (fgetc(patch->f) != 'C') ||
+        (fgetc(patch->f) != 'H')
     ) {
         printf("%s: Invalid patch file format\n", patch_filename);
         goto err;
     }
     //
-    // Open target file
-    //
-    target_file = my_fopen(target_filename, "r+b", &target_size);
-    if(!target_file) { goto err; }
-    printf("Applying %s...\n", patch_filename);
-    //
-    // Main patch application loop
+    // Read every record, making sure its data is actually present
     //
     for(;;) {
+        struct ipsrecord r;
         off_t ofs, len;
-        off_t rlen  = 0;
-        int   rchar = 0;
-        //
-        // Read the beginning of a patch record
-        //
-        ofs = readvalue(patch_file, 3);
+        ofs = readvalue(patch->f, 3);
         if(ofs == -1) { goto err_eof; }
         if(ofs == IPS_EOF) {
             break;
         }
-        len = readvalue(patch_file, 2);
+        len = readvalue(patch->f, 2);
         if(len == -1) { goto err_eof; }
-        if(!len) {
-            rlen = readvalue(patch_file, 2);
-            if(rlen == -1) { goto err_eof; }
-            rchar = fgetc(patch_file);
-            if(rchar == EOF) { goto err_eof; }
+        r.ofs   = ofs;
+        r.data  = 0;
+        r.rle   = 0;
+        r.rchar = 0;
+        if(len) {
+            r.data = ftello(patch->f);
+            if(r.data < 0 || len > patch_size - r.data) { goto err_eof; }
+            if(fseeko(patch->f, len, SEEK_CUR) != 0) { goto err_patch; }
+        } else {
+            int c;
+            len = readvalue(patch->f, 2);
+            if(len == -1) { goto err_eof; }
+            c = fgetc(patch->f);
+            if(c == EOF) { goto err_eof; }
+            r.rle   = 1;
+            r.rchar = (uint8_t)c;
+        }
+        r.len = (uint16_t)len;
+        if(ofs + len > patch->end) {
+            patch->end = ofs + len;
         }
         //
-        // Seek to the appropriate position in the target file
+        // Append to the record list
         //
-        if(ofs <= target_size) {
-            fseeko(target_file, ofs, SEEK_SET);
-        } else {
-            fseeko(target_file, 0, SEEK_END);
-            while(target_size < ofs) {
-                fputc(0, target_file);
-                target_size++;
+        if(patch->count >= capacity) {
+            size_t newcap = capacity ? 2 * capacity : 256;
+            struct ipsrecord *newrec;
+            if(
+                newcap < capacity ||
+                newcap > (((size_t)(-1)) / sizeof(*newrec))
+            ) {
+                goto err_mem;
             }
+            newrec = realloc(patch->rec, newcap * sizeof(*newrec));
+            if(!newrec) { goto err_mem; }
+            patch->rec = newrec;
+            capacity = newcap;
+        }
+        patch->rec[patch->count++] = r;
+    }
+    //
+    // Truncation value is optional
+    //
+    patch->truncate = readvalue(patch->f, 3);
+    return 0;
+
+err_mem:
+    printf("Out of memory\n");
+    goto err;
+err_patch:
+    printfileerror(patch->f, patch_filename);
+    goto err;
+err_eof:
+    printf(
+        "Error: %s: Unexpected end-of-file; patch incomplete\n",
+        patch_filename
+    );
+err:
+    ips_free(patch);
+    return 1;
+}
+
+//
+// Apply a loaded patch to a given target.
+// Returns 0 on success.
+//
+// The target is patched a window at a time in memory (normally the whole
+// 16MiB addressable by IPS in one go), and each window is written back once.
+//
+static int ips_apply(
+    const struct ipspatch *patch,
+    const char            *target_filename
+) {
+    int      returncode = 0;
+    FILE    *target_file = NULL;
+    uint8_t *buf = NULL;
+    off_t    target_size;
+    off_t    new_size;
+    off_t    window;
+    off_t    ofs;
+    size_t   i;
+    //
+    // Open target file
+    //
+    target_file = my_fopen(target_filename, "r+b", &target_size);
+    if(!target_file) { goto err; }
+    new_size = (patch->end > target_size) ? patch->end : target_size;
+    //
+    // Figure out how big each window should be
+    //
+    window = (sizeof(size_t) > 2) ? (IPS_LIMIT + 0x10000L) : 0x8000L;
+    if(window > patch->end) {
+        window = patch->end;
+    }
+    if(window > 0) {
+        buf = malloc((size_t)window);
+        if(!buf) {
+            printf("Out of memory\n");
+            goto err;
         }
+    }
+    for(ofs = 0; ofs < new_size && ofs < patch->end; ofs += window) {
+        off_t  end     = (new_size - ofs < window) ? new_size : ofs + window;
+        size_t n       = (size_t)(end - ofs);
+        int    touched = (end > target_size);
         //
-        // Apply patch block
+        // See if any record lands in this window
         //
-        if(len) {
-            ofs += len;
-            if(ofs > target_size) {
-                target_size = ofs;
-            }
-            while(len--) {
-                rchar = fgetc(patch_file);
-                if(rchar == EOF) { goto err_eof; }
-                fputc(rchar, target_file);
-            }
+        for(i = 0; i < patch->count && !touched; i++) {
+            const struct ipsrecord *r = patch->rec + i;
+            touched = (r->ofs < end) && (r->ofs + r->len > ofs);
+        }
+        if(!touched) {
+            continue;
+        }
+        //
+        // Read existing data, zero-extending past the end of the target
+        //
+        if(ofs < target_size) {
+            size_t have = (target_size - ofs < (off_t)n) ?
+                (size_t)(target_size - ofs) : n;
+            if(fseeko(target_file, ofs, SEEK_SET) != 0) { goto err_target; }
+            if(fread(buf, 1, have, target_file) != have) { goto err_target; }
+            memset(buf + have, 0, n - have);
         } else {
-            ofs += rlen;
-            if(ofs > target_size) {
-                target_size = ofs;
+            memset(buf, 0, n);
+        }
+        //
+        // Apply every record that overlaps, in order
+        //
+        for(i = 0; i < patch->count; i++) {
+            const struct ipsrecord *r = patch->rec + i;
+            off_t lo = (r->ofs > ofs) ? r->ofs : ofs;
+            off_t hi = (r->ofs + r->len < end) ? r->ofs + r->len : end;
+            if(lo >= hi) {
+                continue;
             }
-            while(rlen--) {
-                fputc(rchar, target_file);
+            if(r->rle) {
+                memset(buf + (size_t)(lo - ofs), r->rchar, (size_t)(hi - lo));
+            } else {
+                if(fseeko(patch->f, r->data + (lo - r->ofs), SEEK_SET) != 0) {
+                    goto err_patch;
+                }
+                if(fread(
+                    buf + (size_t)(lo - ofs), 1, (size_t)(hi - lo), patch->f
+                ) != (size_t)(hi - lo)) {
+                    goto err_patch;
+                }
             }
         }
+        //
+        // Write it back
+        //
+        if(fseeko(target_file, ofs, SEEK_SET) != 0) { goto err_target; }
+        if(fwrite(buf, 1, n, target_file) != n) { goto err_target; }
     }
+    if(fclose(target_file) != 0) {
+        target_file = NULL;
+        goto err_target;
+    }
+    target_file = NULL;
     //
     // Perform truncation if necessary
     //
-    fclose(target_file);
-    target_file = NULL;
-    ofs = readvalue(patch_file, 3);
-    if(ofs != -1 && ofs < target_size) {
-        if(truncate(target_filename, ofs) != 0) {
+    if(patch->truncate != -1 && patch->truncate < new_size) {
+        if(truncate(target_filename, patch->truncate) != 0) {
             printf("Warning: Truncate failed\n");
         }
     }
+    goto no_err;
+
+err_patch:
+    printfileerror(patch->f, patch->name);
+    goto err;
+err_target:
+    printfileerror(target_file, target_filename);
+err:
+    returncode = 1;
+no_err:
+    if(target_file) { fclose(target_file); }
+    if(buf) { free(buf); }
+    return returncode;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// A checked UPS or BPS patch
+//
+// The patch is streamed from disk while applying, so only the header is kept.
+//
+struct deltapatch {
+    const char *name;
+    int         format;
+    off_t       start;       // offset of the first block or action
+    off_t       end;         // offset of the footer
+    off_t       source_size;
+    off_t       target_size;
+    uint32_t    source_crc;
+    uint32_t    target_crc;
+};
+
+//
+// Read a number in the variable-length format used by UPS and BPS
+// Returns nonzero past end, or if the number won't fit in an off_t
+//
+static int read_varint(struct ipsbuf* b, off_t* ofs, off_t end, off_t* value) {
+    off_t v = 0;
+    off_t shift = 1;
+    for(;;) {
+        int c = (*ofs < end) ? ipsbuf_byte(b, *ofs) : -1;
+        if(c < 0) {
+            return 1;
+        }
+        (*ofs)++;
+        v += (c & 0x7F) * shift;
+        if(c & 0x80) {
+            break;
+        }
+        if(shift >= (((off_t)1) << (8 * sizeof(off_t) - 16))) {
+            return 1;
+        }
+        shift <<= 7;
+        v += shift;
+    }
+    *value = v;
+    return 0;
+}
+
+static uint32_t read_le32(struct ipsbuf* b, off_t ofs) {
+    uint32_t v = 0;
+    int i;
+    for(i = 3; i >= 0; i--) {
+        v = (v << 8) | (((uint32_t)ipsbuf_byte(b, ofs + i)) & 0xFF);
+    }
+    return v;
+}
+
+//
+// Read and check the header and CRC of a UPS or BPS patch
+// Returns 0 on success
+//
+static int delta_load(
+    struct deltapatch *patch,
+    const char        *patch_filename,
+    int                format
+) {
+    int           returncode = 0;
+    struct ipsbuf b;
+    uint32_t      crc = 0;
+    off_t         ofs = 0;
+    off_t         meta;
+
+    memset(patch, 0, sizeof(*patch));
+    patch->name   = patch_filename;
+    patch->format = format;
+    if(ipsbuf_open(&b, patch_filename)) { goto err; }
+    if(b.size < 16) { goto err_format; }
     //
-    // Finished
+    // Check the patch CRC first, so nothing else needs to worry about
+    // corruption
     //
-    printf("Done\n");
+    while(ofs < b.size - 4) {
+        const uint8_t* p;
+        size_t n = ipsbuf_get(&b, ofs, &p);
+        if(!n) { goto err_patch; }
+        if(((off_t)n) > b.size - 4 - ofs) { n = (size_t)(b.size - 4 - ofs); }
+        crc = crc_update(crc, p, n);
+        ofs += n;
+    }
+    if(crc != read_le32(&b, b.size - 4) || b.error) {
+        if(b.error) { goto err_patch; }
+        printf("Error: %s: Patch file is corrupt (CRC mismatch)\n",
+            patch_filename
+        );
+        goto err;
+    }
+    patch->end        = b.size - 12;
+    patch->source_crc = read_le32(&b, b.size - 12);
+    patch->target_crc = read_le32(&b, b.size -  8);
+    //
+    // Header
+    //
+    ofs = 4;
+    if(
+        read_varint(&b, &ofs, patch->end, &(patch->source_size)) ||
+        read_varint(&b, &ofs, patch->end, &(patch->target_size))
+    ) {
+        goto err_format;
+    }
+    if(format == PATCH_BPS) {
+        if(
+            read_varint(&b, &ofs, patch->end, &meta) ||
+            meta > patch->end - ofs
+        ) {
+            goto err_format;
+        }
+        ofs += meta;
+    }
+    patch->start = ofs;
     goto no_err;
 
-err_eof:
-    printf(
-        "Error: %s: Unexpected end-of-file; patch incomplete\n",
-        patch_filename
-    );
-
+err_patch:
+    printfileerror(b.f, patch_filename);
+    goto err;
+err_format:
+    printf("%s: Invalid patch file format\n", patch_filename);
 err:
     returncode = 1;
+no_err:
+    ipsbuf_close(&b);
+    return returncode;
+}
+
+//
+// Write n bytes from the source at ofs, with zeroes past its end
+//
+static void copy_source(
+    struct outbuf* out,
+    struct ipsbuf* source,
+    off_t          ofs,
+    off_t          n
+) {
+    static const uint8_t zero[256] = {0};
+    while(n > 0) {
+        const uint8_t* p = zero;
+        size_t k = sizeof(zero);
+        if(ofs < source->size) {
+            k = ipsbuf_get(source, ofs, &p);
+            if(!k) {
+                break;
+            }
+        }
+        if(((off_t)k) > n) {
+            k = (size_t)n;
+        }
+        outbuf_write(out, p, k);
+        ofs += k;
+        n   -= k;
+    }
+}
+
+//
+// Apply a loaded UPS or BPS patch to a given target.
+// Returns 0 on success.
+//
+// The result is built in a new temporary file, which replaces the target only
+// once its size and CRC have been checked.  An existing file by that name is
+// never overwritten.
+//
+static int delta_apply(
+    const struct deltapatch *patch,
+    const char              *target_filename
+) {
+    int           returncode = 0;
+    struct ipsbuf p;
+    struct ipsbuf source;
+    struct ipsbuf copy;
+    struct outbuf out;
+    char         *temp_filename = NULL;
+    int           created = 0;
+    uint32_t      crc;
+    off_t         size;
+    off_t         ofs = patch->start;
+
+    memset(&p     , 0, sizeof(p     ));
+    memset(&source, 0, sizeof(source));
+    memset(&copy  , 0, sizeof(copy  ));
+    memset(&out   , 0, sizeof(out   ));
+    //
+    // Make sure this is the right file before doing anything
+    //
+    if(get_file_crc(target_filename, &crc, &size)) { goto err; }
+    if(size != patch->source_size || crc != patch->source_crc) {
+        if(size == patch->target_size && crc == patch->target_crc) {
+            printf("Error: %s is already patched\n", target_filename);
+        } else {
+            printf("Error: %s doesn't match the patch's source file\n",
+                target_filename
+            );
+        }
+        goto err;
+    }
+    temp_filename = malloc(strlen(target_filename) + 5);
+    if(!temp_filename) {
+        printf("Out of memory\n");
+        goto err;
+    }
+    strcpy(temp_filename, target_filename);
+    strcat(temp_filename, ".tmp");
+    if(
+        ipsbuf_open(&p, patch->name) ||
+        ipsbuf_open(&source, target_filename) ||
+        ipsbuf_open(&copy, target_filename) ||
+        outbuf_open(&out, temp_filename, NULL)
+    ) {
+        goto err;
+    }
+    created = 1;
+    copyfilemode(target_filename, temp_filename);
+
+    if(patch->format == PATCH_UPS) {
+        //
+        // pos is the offset in both source and target; anything past the
+        // end of the target is dropped
+        //
+        off_t end = (patch->source_size > patch->target_size) ?
+                    patch->source_size : patch->target_size;
+        off_t pos = 0;
+        while(ofs < patch->end) {
+            off_t skip;
+            if(read_varint(&p, &ofs, patch->end, &skip) || skip > end - pos) {
+                goto err_format;
+            }
+            if(pos < patch->target_size) {
+                copy_source(&out, &source, pos,
+                    (skip < patch->target_size - pos) ?
+                        skip : patch->target_size - pos
+                );
+            }
+            pos += skip;
+            for(;;) {
+                int x = (ofs < patch->end) ? ipsbuf_byte(&p, ofs) : -1;
+                int c = (pos < source.size) ? ipsbuf_byte(&source, pos) : 0;
+                if(x < 0 || c < 0) { goto err_format; }
+                ofs++;
+                if(pos < patch->target_size) {
+                    outbuf_byte(&out, c ^ x);
+                }
+                pos++;
+                if(!x) {
+                    break;
+                }
+            }
+        }
+        if(out.pos < patch->target_size) {
+            copy_source(&out, &source, out.pos, patch->target_size - out.pos);
+        }
+    } else {
+        off_t source_rel = 0;
+        off_t target_rel = 0;
+        while(ofs < patch->end) {
+            off_t action, len, d;
+            if(read_varint(&p, &ofs, patch->end, &action)) { goto err_format; }
+            len = (action >> 2) + 1;
+            if(len > patch->target_size - out.pos) { goto err_format; }
+            switch(action & 3) {
+            case BPS_SOURCE_READ:
+                if(len > patch->source_size - out.pos) { goto err_format; }
+                copy_source(&out, &source, out.pos, len);
+                break;
+            case BPS_TARGET_READ:
+                if(len > patch->end - ofs) { goto err_format; }
+                while(len > 0) {
+                    const uint8_t* q;
+                    size_t n = ipsbuf_get(&p, ofs, &q);
+                    if(!n) { goto err_patch; }
+                    if(((off_t)n) > len) { n = (size_t)len; }
+                    outbuf_write(&out, q, n);
+                    ofs += n;
+                    len -= n;
+                }
+                break;
+            case BPS_SOURCE_COPY:
+                if(read_varint(&p, &ofs, patch->end, &d)) { goto err_format; }
+                source_rel += (d & 1) ? -(d >> 1) : (d >> 1);
+                if(
+                    source_rel < 0 ||
+                    len > patch->source_size - source_rel
+                ) {
+                    goto err_format;
+                }
+                copy_source(&out, &copy, source_rel, len);
+                source_rel += len;
+                break;
+            case BPS_TARGET_COPY:
+                if(read_varint(&p, &ofs, patch->end, &d)) { goto err_format; }
+                target_rel += (d & 1) ? -(d >> 1) : (d >> 1);
+                if(target_rel < 0 || target_rel >= out.pos) {
+                    goto err_format;
+                }
+                outbuf_copy(&out, target_rel, len);
+                target_rel += len;
+                break;
+            }
+        }
+    }
+    //
+    // Check everything came out right
+    //
+    if(p.error) { goto err_patch; }
+    if(source.error || copy.error) {
+        printfileerror(source.f, target_filename);
+        goto err;
+    }
+    outbuf_flush(&out);
+    if(out.pos != patch->target_size || out.crc != patch->target_crc) {
+        printf("Error: %s: Patched result doesn't match the expected CRC\n",
+            target_filename
+        );
+        goto err;
+    }
+    ipsbuf_close(&source);
+    ipsbuf_close(&copy);
+    if(outbuf_close(&out)) { goto err; }
+    //
+    // Replace the target
+    //
+    if(rename(temp_filename, target_filename) != 0) {
+        remove(target_filename);
+        if(rename(temp_filename, target_filename) != 0) {
+            //
+            // Leave the result in the temporary file rather than lose it
+            //
+            printf("Error: Unable to rename %s to %s\n",
+                temp_filename, target_filename
+            );
+            returncode = 1;
+        }
+    }
+    goto no_err;
 
+err_patch:
+    printfileerror(p.f, patch->name);
+    goto err;
+err_format:
+    printf("%s: Invalid patch file format\n", patch->name);
+err:
+    returncode = 1;
+    //
+    // Only remove the temporary file if it's the one we created
+    //
+    if(created) {
+        outbuf_close(&out);
+        remove(temp_filename);
+    }
 no_err:
-    if(target_file) { fclose(target_file); }
-    if( patch_file) { fclose( patch_file); }
+    ipsbuf_close(&p);
+    ipsbuf_close(&source);
+    ipsbuf_close(&copy);
+    outbuf_close(&out);
+    if(temp_filename) { free(temp_filename); }
     return returncode;
 }
 
+//
+// Figure out the format of an existing patch file from its signature
+//
+static int detect_patch_format(const char* filename) {
+    char sig[4];
+    int format = PATCH_IPS;
+    FILE* f = fopen(filename, "rb");
+    if(f) {
+        if(fread(sig, 1, 4, f) == 4) {
+            if(!memcmp(sig, "UPS1", 4)) { format = PATCH_UPS; }
+            if(!memcmp(sig, "BPS1", 4)) { format = PATCH_BPS; }
+        }
+        fclose(f);
+    }
+    return format;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Apply a patch to any number of targets, reading the patch only once.
+// Each patched target's CRC32 is reported.
+// Returns 0 if every target was patched successfully.
+//
+static int apply_patch(
+    const char  *patch_filename,
+    size_t       target_nfiles,
+    const char **target_filename
+) {
+    struct ipspatch   patch;
+    struct deltapatch delta;
+    int               format = detect_patch_format(patch_filename);
+    size_t            i;
+    size_t            nerrors = 0;
+    //
+    // Read and check the whole patch first, so a bad patch never touches any
+    // target
+    //
+    if(format == PATCH_IPS) {
+        if(ips_load(&patch, patch_filename)) {
+            return 1;
+        }
+    } else {
+        if(delta_load(&delta, patch_filename, format)) {
+            return 1;
+        }
+    }
+    printf("Applying %s...\n", patch_filename);
+    for(i = 0; i < target_nfiles; i++) {
+        uint32_t crc = (format == PATCH_IPS) ? 0 : delta.target_crc;
+        if(
+            (format == PATCH_IPS) ? (
+                ips_apply(&patch, target_filename[i]) ||
+                get_file_crc(target_filename[i], &crc, NULL)
+            ) :
+                delta_apply(&delta, target_filename[i])
+        ) {
+            printf("Error: %s was not patched\n", target_filename[i]);
+            nerrors++;
+            continue;
+        }
+        printf("%08lX  %s\n", (unsigned long)crc, target_filename[i]);
+    }
+    if(format == PATCH_IPS) {
+        ips_free(&patch);
+    }
+    if(nerrors) {
+        fprintdec(stdout, nerrors);
+        printf(" of ");
+        fprintdec(stdout, target_nfiles);
+        printf(" target(s) failed\n");
+        return 1;
+    }
+    printf("Done\n");
+    return 0;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 int main(
@@ -526,6 +2514,7 @@ int main(
     char cmd;
 
     normalize_argv0(argv[0]);
+    crc_init();
 
     if(argc < 2) {
         banner();
@@ -548,10 +2537,14 @@ int main(
         break;
     case 'a':
     case 'A':
-        if(argc != 4) {
+        if(argc < 4) {
             goto usage;
         }
-        returncode = apply_patch(argv[2], argv[3]);
+        returncode = apply_patch(
+            argv[2],
+            argc - 3,
+            (const char**)(argv + 3)
+        );
         break;
     default:
         printf("Unknown command: %s\n", argv[1]);
@@ -566,7 +2559,8 @@ usage:
         "To create an IPS patch:\n"
         "  %s c patch_file source_file(s) target_file\n"
         "To apply an IPS patch:\n"
-        "  %s a patch_file target_file\n",
+        "  %s a patch_file target_file(s)\n"
+        "Patch files ending in .ups or .bps are created in that format\n",
         argv[0], argv[0]
     );
     returncode = 1;
@@ -36,36 +36,781 @@ static int usfv_isspace(int c) {
 
 ////////////////////////////////////////////////////////////////////////////////
 
-static int getfilecrc(
-    const char *filename,
-    uint32_t *crc_out
+//
+// Slice-by-16 CRC32
+//
+// crctable[0] is the usual byte-at-a-time table; crctable[k] advances a byte's
+// contribution through k more zero bytes, so 16 bytes can be folded in at once.
+// Bytes are assembled explicitly, so this works regardless of endianness.
+//
+static uint32_t crctable[16][256];
+
+static void crc_init(void) {
+    uint32_t i, j, k;
+    for(i = 0; i < 256; i++) {
+        j = i;
+        for(k = 0; k < 8; k++) {
+            j = (j >> 1) ^ ((j & 1) ? 0xEDB88320 : 0);
+        }
+        crctable[0][i] = j;
+    }
+    for(i = 0; i < 256; i++) {
+        for(k = 1; k < 16; k++) {
+            j = crctable[k - 1][i];
+            crctable[k][i] = (j >> 8) ^ crctable[0][j & 0xFF];
+        }
+    }
+}
+
+static uint32_t crc_update(uint32_t crc, const uint8_t *p, size_t n) {
+    crc = ~crc;
+    while(n >= 16) {
+        uint32_t a = crc ^ (
+            (((uint32_t)(p[0])) <<  0) |
+            (((uint32_t)(p[1])) <<  8) |
+            (((uint32_t)(p[2])) << 16) |
+            (((uint32_t)(p[3])) << 24)
+        );
+        crc =
+            crctable[15][(a      ) & 0xFF] ^
+            crctable[14][(a >>  8) & 0xFF] ^
+            crctable[13][(a >> 16) & 0xFF] ^
+            crctable[12][(a >> 24)       ] ^
+            crctable[11][p[ 4]] ^ crctable[10][p[ 5]] ^
+            crctable[ 9][p[ 6]] ^ crctable[ 8][p[ 7]] ^
+            crctable[ 7][p[ 8]] ^ crctable[ 6][p[ 9]] ^
+            crctable[ 5][p[10]] ^ crctable[ 4][p[11]] ^
+            crctable[ 3][p[12]] ^ crctable[ 2][p[13]] ^
+            crctable[ 1][p[14]] ^ crctable[ 0][p[15]];
+        p += 16;
+        n -= 16;
+    }
+    while(n--) {
+        crc = (crc >> 8) ^ crctable[0][(crc ^ (*p++)) & 0xFF];
+    }
+    return ~crc;
+}
+
+//
+// MD5 (RFC 1321)
+//
+struct md5 {
+    uint32_t h[4];
+    uint32_t lo, hi;   // byte count
+    uint8_t  buf[64];
+};
+
+static const uint32_t md5_k[64] = {
+    0xD76AA478LU, 0xE8C7B756LU, 0x242070DBLU, 0xC1BDCEEELU,
+    0xF57C0FAFLU, 0x4787C62ALU, 0xA8304613LU, 0xFD469501LU,
+    0x698098D8LU, 0x8B44F7AFLU, 0xFFFF5BB1LU, 0x895CD7BELU,
+    0x6B901122LU, 0xFD987193LU, 0xA679438ELU, 0x49B40821LU,
+    0xF61E2562LU, 0xC040B340LU, 0x265E5A51LU, 0xE9B6C7AALU,
+    0xD62F105DLU, 0x02441453LU, 0xD8A1E681LU, 0xE7D3FBC8LU,
+    0x21E1CDE6LU, 0xC33707D6LU, 0xF4D50D87LU, 0x455A14EDLU,
+    0xA9E3E905LU, 0xFCEFA3F8LU, 0x676F02D9LU, 0x8D2A4C8ALU,
+    0xFFFA3942LU, 0x8771F681LU, 0x6D9D6122LU, 0xFDE5380CLU,
+    0xA4BEEA44LU, 0x4BDECFA9LU, 0xF6BB4B60LU, 0xBEBFBC70LU,
+    0x289B7EC6LU, 0xEAA127FALU, 0xD4EF3085LU, 0x04881D05LU,
+    0xD9D4D039LU, 0xE6DB99E5LU, 0x1FA27CF8LU, 0xC4AC5665LU,
+    0xF4292244LU, 0x432AFF97LU, 0xAB9423A7LU, 0xFC93A039LU,
+    0x655B59C3LU, 0x8F0CCC92LU, 0xFFEFF47DLU, 0x85845DD1LU,
+    0x6FA87E4FLU, 0xFE2CE6E0LU, 0xA3014314LU, 0x4E0811A1LU,
+    0xF7537E82LU, 0xBD3AF235LU, 0x2AD7D2BBLU, 0xEB86D391LU
+};
+
+static const uint8_t md5_r[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+#define ROTL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void md5_block(uint32_t *h, const uint8_t *p) {
+    uint32_t w[16];
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+    unsigned i;
+    for(i = 0; i < 16; i++) {
+        w[i] =
+            (((uint32_t)(p[4 * i + 0])) <<  0) |
+            (((uint32_t)(p[4 * i + 1])) <<  8) |
+            (((uint32_t)(p[4 * i + 2])) << 16) |
+            (((uint32_t)(p[4 * i + 3])) << 24);
+    }
+    for(i = 0; i < 64; i++) {
+        uint32_t f, t;
+        unsigned g;
+        if(i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if(i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) & 15;
+        } else if(i < 48) {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) & 15;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) & 15;
+        }
+        t = a + f + md5_k[i] + w[g];
+        a = d;
+        d = c;
+        c = b;
+        b = b + ROTL32(t, md5_r[i]);
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+}
+
+static void md5_init(struct md5 *m) {
+    m->h[0] = 0x67452301LU;
+    m->h[1] = 0xEFCDAB89LU;
+    m->h[2] = 0x98BADCFELU;
+    m->h[3] = 0x10325476LU;
+    m->lo = 0;
+    m->hi = 0;
+}
+
+static void md5_update(struct md5 *m, const uint8_t *p, size_t n) {
+    size_t have = (size_t)(m->lo & 63);
+    uint32_t lo = m->lo;
+    m->lo += (uint32_t)n;
+    if(m->lo < lo) { m->hi++; }
+    if(have) {
+        size_t k = 64 - have;
+        if(k > n) { k = n; }
+        memcpy(m->buf + have, p, k);
+        p += k;
+        n -= k;
+        if(have + k < 64) { return; }
+        md5_block(m->h, m->buf);
+    }
+    for(; n >= 64; p += 64, n -= 64) {
+        md5_block(m->h, p);
+    }
+    memcpy(m->buf, p, n);
+}
+
+static void md5_final(struct md5 *m, uint8_t *out) {
+    static const uint8_t pad[64] = { 0x80 };
+    uint8_t len[8];
+    unsigned i;
+    uint32_t lo = m->lo << 3;
+    uint32_t hi = (m->hi << 3) | (m->lo >> 29);
+    for(i = 0; i < 4; i++) {
+        len[i    ] = (uint8_t)(lo >> (8 * i));
+        len[i + 4] = (uint8_t)(hi >> (8 * i));
+    }
+    md5_update(m, pad, 1 + ((119 - (m->lo & 63)) & 63));
+    md5_update(m, len, 8);
+    for(i = 0; i < 16; i++) {
+        out[i] = (uint8_t)(m->h[i >> 2] >> (8 * (i & 3)));
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// SHA-256 (FIPS 180-2)
+//
+struct sha256 {
+    uint32_t h[8];
+    uint32_t lo, hi;   // byte count
+    uint8_t  buf[64];
+};
+
+static const uint32_t sha256_k[64] = {
+    0x428A2F98LU, 0x71374491LU, 0xB5C0FBCFLU, 0xE9B5DBA5LU,
+    0x3956C25BLU, 0x59F111F1LU, 0x923F82A4LU, 0xAB1C5ED5LU,
+    0xD807AA98LU, 0x12835B01LU, 0x243185BELU, 0x550C7DC3LU,
+    0x72BE5D74LU, 0x80DEB1FELU, 0x9BDC06A7LU, 0xC19BF174LU,
+    0xE49B69C1LU, 0xEFBE4786LU, 0x0FC19DC6LU, 0x240CA1CCLU,
+    0x2DE92C6FLU, 0x4A7484AALU, 0x5CB0A9DCLU, 0x76F988DALU,
+    0x983E5152LU, 0xA831C66DLU, 0xB00327C8LU, 0xBF597FC7LU,
+    0xC6E00BF3LU, 0xD5A79147LU, 0x06CA6351LU, 0x14292967LU,
+    0x27B70A85LU, 0x2E1B2138LU, 0x4D2C6DFCLU, 0x53380D13LU,
+    0x650A7354LU, 0x766A0ABBLU, 0x81C2C92ELU, 0x92722C85LU,
+    0xA2BFE8A1LU, 0xA81A664BLU, 0xC24B8B70LU, 0xC76C51A3LU,
+    0xD192E819LU, 0xD6990624LU, 0xF40E3585LU, 0x106AA070LU,
+    0x19A4C116LU, 0x1E376C08LU, 0x2748774CLU, 0x34B0BCB5LU,
+    0x391C0CB3LU, 0x4ED8AA4ALU, 0x5B9CCA4FLU, 0x682E6FF3LU,
+    0x748F82EELU, 0x78A5636FLU, 0x84C87814LU, 0x8CC70208LU,
+    0x90BEFFFALU, 0xA4506CEBLU, 0xBEF9A3F7LU, 0xC67178F2LU
+};
+
+static void sha256_block(uint32_t *h, const uint8_t *p) {
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, k;
+    unsigned i;
+    for(i = 0; i < 16; i++) {
+        w[i] =
+            (((uint32_t)(p[4 * i + 0])) << 24) |
+            (((uint32_t)(p[4 * i + 1])) << 16) |
+            (((uint32_t)(p[4 * i + 2])) <<  8) |
+            (((uint32_t)(p[4 * i + 3])) <<  0);
+    }
+    for(; i < 64; i++) {
+        uint32_t s0 =
+            ROTR32(w[i - 15],  7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >>  3);
+        uint32_t s1 =
+            ROTR32(w[i -  2], 17) ^ ROTR32(w[i -  2], 19) ^ (w[i -  2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    a = h[0]; b = h[1]; c = h[2]; d = h[3];
+    e = h[4]; f = h[5]; g = h[6]; k = h[7];
+    for(i = 0; i < 64; i++) {
+        uint32_t t1 = k +
+            (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) +
+            ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 =
+            (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) +
+            ((a & b) ^ (a & c) ^ (b & c));
+        k = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+static void sha256_init(struct sha256 *s) {
+    s->h[0] = 0x6A09E667LU; s->h[1] = 0xBB67AE85LU;
+    s->h[2] = 0x3C6EF372LU; s->h[3] = 0xA54FF53ALU;
+    s->h[4] = 0x510E527FLU; s->h[5] = 0x9B05688CLU;
+    s->h[6] = 0x1F83D9ABLU; s->h[7] = 0x5BE0CD19LU;
+    s->lo = 0;
+    s->hi = 0;
+}
+
+static void sha256_update(struct sha256 *s, const uint8_t *p, size_t n) {
+    size_t have = (size_t)(s->lo & 63);
+    uint32_t lo = s->lo;
+    s->lo += (uint32_t)n;
+    if(s->lo < lo) { s->hi++; }
+    if(have) {
+        size_t k = 64 - have;
+        if(k > n) { k = n; }
+        memcpy(s->buf + have, p, k);
+        p += k;
+        n -= k;
+        if(have + k < 64) { return; }
+        sha256_block(s->h, s->buf);
+    }
+    for(; n >= 64; p += 64, n -= 64) {
+        sha256_block(s->h, p);
+    }
+    memcpy(s->buf, p, n);
+}
+
+static void sha256_final(struct sha256 *s, uint8_t *out) {
+    static const uint8_t pad[64] = { 0x80 };
+    uint8_t len[8];
+    unsigned i;
+    uint32_t lo = s->lo << 3;
+    uint32_t hi = (s->hi << 3) | (s->lo >> 29);
+    for(i = 0; i < 4; i++) {
+        len[3 - i] = (uint8_t)(hi >> (8 * i));
+        len[7 - i] = (uint8_t)(lo >> (8 * i));
+    }
+    sha256_update(s, pad, 1 + ((119 - (s->lo & 63)) & 63));
+    sha256_update(s, len, 8);
+    for(i = 0; i < 32; i++) {
+        out[i] = (uint8_t)(s->h[i >> 2] >> (8 * (3 - (i & 3))));
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Every digest usfv knows, computed together in one pass over each file
+//
+enum {
+    DIGEST_CRC32  = 1,
+    DIGEST_MD5    = 2,
+    DIGEST_SHA256 = 4
+};
+
+struct digests {
+    uint32_t crc;
+    uint8_t  md5[16];
+    uint8_t  sha256[32];
+};
+
+static uint8_t read_buffer[0x8000];
+
+//
+// Compute the requested digests of a file
+// Returns nonzero on error, with errno set
+//
+static int getfiledigests(
+    const char     *filename,
+    int             which,
+    struct digests *d
 ) {
-    static uint32_t crctable[256];
-    static char initialized = 0;
+    struct md5    md5;
+    struct sha256 sha256;
     uint32_t crc = 0;
     FILE *f;
-    if(!initialized) {
-        uint32_t i, j, k;
-        for(i = 0; i < 256; i++) {
-            j = i ^ 0xFF;
-            for (k = 0; k < 8; k++) {
-                j = (j & 1) ? 0xEDB88320 ^ (j >> 1) : j >> 1;
+    f = fopen(filename, "rb");
+    if(!f) { return -1; }
+    md5_init(&md5);
+    sha256_init(&sha256);
+    for(;;) {
+        size_t n = fread(read_buffer, 1, sizeof(read_buffer), f);
+        if(which & DIGEST_CRC32 ) { crc = crc_update(crc, read_buffer, n); }
+        if(which & DIGEST_MD5   ) { md5_update   (&md5   , read_buffer, n); }
+        if(which & DIGEST_SHA256) { sha256_update(&sha256, read_buffer, n); }
+        if(n < sizeof(read_buffer)) { break; }
+    }
+    if(ferror(f)) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    d->crc = crc;
+    if(which & DIGEST_MD5   ) { md5_final   (&md5   , d->md5   ); }
+    if(which & DIGEST_SHA256) { sha256_final(&sha256, d->sha256); }
+    return 0;
+}
+
+//
+// Checksum lists besides SFV: one "digest  filename" line per file, as
+// written by md5sum and sha256sum
+//
+struct hashlist {
+    const char *ext;
+    const char *title;
+    int         digest;
+    size_t      size;
+};
+
+enum { NHASHLISTS = 2 };
+
+static const struct hashlist hashlists[NHASHLISTS] = {
+    { "md5"   , "MD5"    , DIGEST_MD5   , 16 },
+    { "sha256", "SHA-256", DIGEST_SHA256, 32 }
+};
+
+static uint8_t* digest_bytes(struct digests *d, int which) {
+    return (which == DIGEST_MD5) ? d->md5 : d->sha256;
+}
+
+//
+// Pick the list format from the filename extension
+// Returns NULL for SFV
+//
+static const struct hashlist* get_hashlist(const char *filename) {
+    const char *ext = strrchr(filename, '.');
+    size_t i, j;
+    if(!ext) { return NULL; }
+    ext++;
+    for(i = 0; i < NHASHLISTS; i++) {
+        const char *s = hashlists[i].ext;
+        for(j = 0; s[j]; j++) {
+            if(tolower((uint8_t)ext[j]) != s[j]) { break; }
+        }
+        if(!s[j] && !ext[j]) {
+            return hashlists + i;
+        }
+    }
+    return NULL;
+}
+
+static void fprinthexdigest(FILE *f, const uint8_t *p, size_t n) {
+    size_t i;
+    for(i = 0; i < n; i++) {
+        fprintf(f, "%02x", (int)(p[i]));
+    }
+}
+
+//
+// Parse exactly n bytes of hex digits
+// Returns nonzero if it's malformed
+//
+static int parse_hex_digest(const char *s, uint8_t *out, size_t n) {
+    size_t i;
+    for(i = 0; i < 2 * n; i++) {
+        int c = tolower((uint8_t)s[i]);
+        int v;
+        if(c >= '0' && c <= '9') {
+            v = c - '0';
+        } else if(c >= 'a' && c <= 'f') {
+            v = c - 'a' + 10;
+        } else {
+            return 1;
+        }
+        if(i & 1) {
+            out[i >> 1] |= (uint8_t)v;
+        } else {
+            out[i >> 1] = (uint8_t)(v << 4);
+        }
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// A file to be hashed
+//
+struct sfventry {
+    char         *name;       // NULL if it should be skipped
+    struct digests expect;    // expected digest, when verifying
+    struct digests actual;    // digest read, when verifying
+    size_t        index;      // position in the list, when verifying
+    unsigned long dev;        // device the file is on
+    unsigned long ino;
+    unsigned long mtime;
+    off_t         size;
+    int           error;      // errno, if it couldn't be read
+    char          statted;
+    char          prefetched;
+    char          done;
+    char          failed;
+};
+
+static void set_entry_stat(struct sfventry* e, const struct stat* st) {
+    e->dev     = (unsigned long)(st->st_dev);
+    e->ino     = (unsigned long)(st->st_ino);
+    e->mtime   = (unsigned long)(st->st_mtime);
+    e->size    = st->st_size;
+    e->statted = 1;
+}
+
+static void stat_entry(struct sfventry* e) {
+    struct stat mystat;
+    memset(&mystat, 0, sizeof(mystat));
+    if(stat(e->name, &mystat) >= 0) {
+        set_entry_stat(e, &mystat);
+    }
+}
+
+//
+// Read-ahead
+//
+// Files are still hashed one at a time, but the OS can be asked to start
+// reading the next few while the current one is hashed.  At most
+// "depth" files are read at once from each device, so a single spinning disk
+// can be limited to one file at a time while other devices read ahead.
+//
+enum { READAHEAD_SCAN = 64 };
+static const off_t READAHEAD_MAX = 0x4000000L;
+
+//
+// Called before hashing entry i
+//
+static void readahead(
+    struct sfventry *entry,
+    size_t           n,
+    size_t           i,
+    size_t           depth
+) {
+    size_t j, k;
+    if(depth < 2) { return; }
+    for(j = i + 1; j < n && j <= i + READAHEAD_SCAN; j++) {
+        size_t inflight = 1;
+        if(!entry[j].name || entry[j].prefetched) { continue; }
+        //
+        // The file being hashed now counts as one in flight on its device
+        //
+        if(entry[i].dev != entry[j].dev) { inflight = 0; }
+        for(k = i + 1; k < j; k++) {
+            if(entry[k].prefetched && entry[k].dev == entry[j].dev) {
+                inflight++;
             }
-            crctable[i] = j ^ 0xFF000000;
         }
-        initialized = 1;
+        if(inflight < depth) {
+            prefetchfile(entry[j].name,
+                (entry[j].size < READAHEAD_MAX) ? entry[j].size : READAHEAD_MAX
+            );
+            entry[j].prefetched = 1;
+        }
     }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// CRC cache
+//
+// Remembers each file's CRC along with its device, inode, size, and
+// modification time, so unchanged files don't need to be read again.  Files
+// modified within the last couple of seconds aren't cached, since another
+// change in the same second wouldn't alter the timestamp.
+//
+// The cache file is text, one file per line, sorted by name:
+//   crc size mtime dev ino name
+//
+static const char cache_magic[] = "usfv cache";
+
+struct cacheentry {
+    char         *name;
+    uint32_t      crc;
+    unsigned long dev;
+    unsigned long ino;
+    unsigned long mtime;
+    off_t         size;
+};
+
+struct crccache {
+    const char        *filename;  // NULL if there's no cache
+    struct cacheentry *entry;
+    size_t             n;
+    size_t             nsorted;   // entries before this are sorted by name
+    size_t             size;
+    int                dirty;
+    size_t             nhits;
+};
+
+static int cacheentry_compare(const void* a, const void* b) {
+    return strcmp(
+        ((const struct cacheentry*)a)->name,
+        ((const struct cacheentry*)b)->name
+    );
+}
+
+static void cache_free(struct crccache* c) {
+    size_t i;
+    for(i = 0; i < c->n; i++) {
+        free(c->entry[i].name);
+    }
+    if(c->entry) { free(c->entry); }
+    memset(c, 0, sizeof(*c));
+}
+
+//
+// Append an entry, taking ownership of name
+// Returns nonzero if out of memory (name is freed)
+//
+static int cache_append(struct crccache* c, const struct cacheentry* e) {
+    if(c->n >= c->size) {
+        size_t newsize = c->size ? 2 * c->size : 256;
+        struct cacheentry* newentry;
+        if(
+            newsize < c->size ||
+            newsize > (((size_t)(-1)) / sizeof(*newentry))
+        ) {
+            goto nomem;
+        }
+        newentry = realloc(c->entry, newsize * sizeof(*newentry));
+        if(!newentry) { goto nomem; }
+        c->entry = newentry;
+        c->size  = newsize;
+    }
+    c->entry[c->n++] = *e;
+    return 0;
+nomem:
+    printf("Out of memory\n");
+    free(e->name);
+    return 1;
+}
+
+static struct cacheentry* cache_find(struct crccache* c, const char* name) {
+    struct cacheentry key;
+    key.name = (char*)name;
+    if(!c->nsorted) {
+        return NULL;
+    }
+    return bsearch(
+        &key, c->entry, c->nsorted, sizeof(key), cacheentry_compare
+    );
+}
+
+//
+// Parse one space-terminated number from a cache line
+// Returns nonzero if it's malformed
+//
+static int cache_number(char** p, unsigned long* value, int base) {
+    char* end;
+    *value = strtoul(*p, &end, base);
+    if(end == *p || *end != ' ') {
+        return 1;
+    }
+    *p = end + 1;
+    return 0;
+}
+
+//
+// Load the cache; a missing cache file is fine
+// Returns nonzero on error
+//
+static int cache_load(struct crccache* c, const char* filename) {
+    static char line[BIG_FILENAME_SIZE + 100];
+    FILE* f;
+    size_t i, j;
+
+    memset(c, 0, sizeof(*c));
+    c->filename = filename;
     f = fopen(filename, "rb");
-    if(!f) { return -1; }
-    if(crc_out) {
-        for(;;) {
-            int c = fgetc(f);
-            if(c == EOF) { break; }
-            crc = (crc >> 8) ^ crctable[(crc ^ c) & 0xFF];
+    if(!f) {
+        return 0;
+    }
+    if(
+        !fgets(line, sizeof(line), f) ||
+        strncmp(line, cache_magic, sizeof(cache_magic) - 1)
+    ) {
+        printf("Error: %s is not a CRC cache file\n", filename);
+        fclose(f);
+        c->filename = NULL;
+        return 1;
+    }
+    while(fgets(line, sizeof(line), f)) {
+        struct cacheentry e;
+        unsigned long crc;
+        char *p = line;
+        char *end;
+        size_t len = strlen(line);
+        //
+        // Ignore anything malformed; it will just be rehashed
+        //
+        if(!len || line[len - 1] != '\n') { continue; }
+        line[--len] = 0;
+        if(len && line[len - 1] == '\r') { line[--len] = 0; }
+        if(cache_number(&p, &crc, 16)) { continue; }
+        e.crc  = crc;
+        e.size = strtoofft(p, &end, 10);
+        if(end == p || *end != ' ') { continue; }
+        p = end + 1;
+        if(
+            cache_number(&p, &(e.mtime), 10) ||
+            cache_number(&p, &(e.dev  ), 10) ||
+            cache_number(&p, &(e.ino  ), 10) ||
+            !*p
+        ) {
+            continue;
+        }
+        e.name = malloc(strlen(p) + 1);
+        if(!e.name) {
+            printf("Out of memory\n");
+            fclose(f);
+            cache_free(c);
+            return 1;
+        }
+        strcpy(e.name, p);
+        if(cache_append(c, &e)) {
+            fclose(f);
+            cache_free(c);
+            return 1;
         }
-        *crc_out = crc;
     }
     fclose(f);
+    //
+    // Sort, keeping only the last entry for any name
+    //
+    qsort(c->entry, c->n, sizeof(*(c->entry)), cacheentry_compare);
+    for(i = 0, j = 0; i < c->n; i++) {
+        if(j && !strcmp(c->entry[j - 1].name, c->entry[i].name)) {
+            free(c->entry[j - 1].name);
+            j--;
+        }
+        c->entry[j++] = c->entry[i];
+    }
+    c->n       = j;
+    c->nsorted = j;
+    c->filename = filename;
+    return 0;
+}
+
+//
+// Save the cache, if anything changed
+// Returns nonzero on error
+//
+static int cache_save(struct crccache* c) {
+    FILE* f = NULL;
+    size_t i;
+    if(!c->filename || !c->dirty) {
+        return 0;
+    }
+    qsort(c->entry, c->n, sizeof(*(c->entry)), cacheentry_compare);
+    f = fopen(c->filename, "wb");
+    if(!f) { goto error_f; }
+    fprintf(f, "%s\n", cache_magic);
+    for(i = 0; i < c->n; i++) {
+        const struct cacheentry* e = c->entry + i;
+        fprintf(f, "%08lX ", (unsigned long)(e->crc));
+        fprintdec(f, e->size);
+        fprintf(f, " %lu %lu %lu %s\n", e->mtime, e->dev, e->ino, e->name);
+    }
+    if(fflush(f) != 0 || ferror(f)) { goto error_f; }
+    fclose(f);
+    return 0;
+
+error_f:
+    printfileerror(f, c->filename);
+    if(f) { fclose(f); }
+    //
+    // Don't leave a partial cache behind
+    //
+    remove(c->filename);
+    return 1;
+}
+
+//
+// Get a file's digests, taking the CRC from the cache if the file is
+// unchanged and the CRC is all that's wanted
+// Returns nonzero on error, with errno set
+//
+static int getdigests(
+    struct crccache *c,
+    struct sfventry *e,
+    int              which,
+    struct digests  *d
+) {
+    struct cacheentry *ce;
+    struct cacheentry  add;
+    time_t now;
+    if(!c->filename || !(which & DIGEST_CRC32)) {
+        return getfiledigests(e->name, which, d);
+    }
+    if(!e->statted) {
+        stat_entry(e);
+    }
+    ce = cache_find(c, e->name);
+    if(
+        which == DIGEST_CRC32 &&
+        e->statted && ce &&
+        ce->dev   == e->dev   &&
+        ce->ino   == e->ino   &&
+        ce->size  == e->size  &&
+        ce->mtime == e->mtime
+    ) {
+        d->crc = ce->crc;
+        c->nhits++;
+        return 0;
+    }
+    now = time(NULL);
+    if(getfiledigests(e->name, which, d)) {
+        return -1;
+    }
+    //
+    // Only cache files that have been left alone for a little while
+    //
+    if(!e->statted || e->mtime + 2 > (unsigned long)now) {
+        return 0;
+    }
+    if(ce) {
+        ce->crc   = d->crc;
+        ce->dev   = e->dev;
+        ce->ino   = e->ino;
+        ce->size  = e->size;
+        ce->mtime = e->mtime;
+        c->dirty  = 1;
+        return 0;
+    }
+    add.name = malloc(strlen(e->name) + 1);
+    if(!add.name) {
+        return 0;
+    }
+    strcpy(add.name, e->name);
+    add.crc   = d->crc;
+    add.dev   = e->dev;
+    add.ino   = e->ino;
+    add.size  = e->size;
+    add.mtime = e->mtime;
+    if(!cache_append(c, &add)) {
+        c->dirty = 1;
+    }
     return 0;
 }
 
@@ -91,19 +836,45 @@ static struct tm my_localtime(time_t t) {
 static off_t sfvcreate(
     char *sfvfilename,
     char **filename,
-    size_t n
+    size_t n,
+    size_t depth,
+    struct crccache *cache,
+    const char **listfilename
 ) {
     off_t nerrors = 0;
     FILE *sfvfile = NULL;
+    FILE *listfile[NHASHLISTS];
+    struct sfventry *entry = NULL;
 
     size_t i = 0;
+    size_t k;
+    int which = DIGEST_CRC32;
     off_t nfiles_done = 0;
 
+    memset(listfile, 0, sizeof(listfile));
     sfvfile = fopen(sfvfilename, "rb");
     if(sfvfile) {
         printf("Error: %s already exists; will not overwrite\n", sfvfilename);
         goto error;
     }
+    for(k = 0; k < NHASHLISTS; k++) {
+        if(!listfilename[k]) { continue; }
+        listfile[k] = fopen(listfilename[k], "rb");
+        if(listfile[k]) {
+            printf("Error: %s already exists; will not overwrite\n",
+                listfilename[k]
+            );
+            goto error;
+        }
+        which |= hashlists[k].digest;
+    }
+    if(n) {
+        entry = calloc(n, sizeof(*entry));
+        if(!entry) {
+            printf("Out of memory\n");
+            goto error;
+        }
+    }
     sfvfile = fopen(sfvfilename, "wb");
     if(!sfvfile) { goto error_sfvfile; }
     printf("Creating SFV file %s\n", sfvfilename);
@@ -127,6 +898,15 @@ static off_t sfvcreate(
     fputc(';' , sfvfile);
     fputc('\r', sfvfile);
     fputc('\n', sfvfile);
+    for(k = 0; k < NHASHLISTS; k++) {
+        if(!listfilename[k]) { continue; }
+        listfile[k] = fopen(listfilename[k], "wb");
+        if(!listfile[k]) {
+            printfileerror(NULL, listfilename[k]);
+            goto error;
+        }
+        printf("Creating %s file %s\n", hashlists[k].title, listfilename[k]);
+    }
     //
     // Write comments indicating file lengths/times
     //
@@ -134,6 +914,7 @@ static off_t sfvcreate(
         struct stat mystat;
         int r;
         memset(&mystat, 0, sizeof(mystat));
+        entry[i].name = filename[i];
         r = stat(filename[i], &mystat);
         if(r >= 0) {
             size_t s;
@@ -141,9 +922,10 @@ static off_t sfvcreate(
             char buf[24];
             if(S_ISDIR(mystat.st_mode)) {
                 // Skip directories
-                filename[i] = NULL;
+                entry[i].name = NULL;
                 continue;
             }
+            set_entry_stat(entry + i, &mystat);
             my_tm = my_localtime(mystat.st_mtime);
             memset(buf, 0, sizeof(buf));
             s = strftime(buf, sizeof(buf)-1, "%H:%M.%S %Y-%m-%d", &my_tm);
@@ -154,20 +936,23 @@ static off_t sfvcreate(
         }
     }
     //
-    // Calculate CRCs
+    // Calculate CRCs, and any other digests, in one pass over each file
     //
     for(i = 0; i < n; i++) {
-        uint32_t crc = 0;
+        struct digests d;
+        uint32_t crc;
         int r;
-        if(!filename[i]) { continue; }
+        if(!entry[i].name) { continue; }
+        readahead(entry, n, i, depth);
         printf("%-22s ", filename[i]);
         fflush(stdout);
-        r = getfilecrc(filename[i], &crc);
+        r = getdigests(cache, entry + i, which, &d);
         if(r) {
             printf("%s\n", strerror(errno));
             nerrors++;
             continue;
         }
+        crc = d.crc;
         printf("%02X%02X%02X%02X\n",
             (int)((crc >> 24) & 0xFF),
             (int)((crc >> 16) & 0xFF),
@@ -184,6 +969,13 @@ static off_t sfvcreate(
         );
         fputc('\r', sfvfile);
         fputc('\n', sfvfile);
+        for(k = 0; k < NHASHLISTS; k++) {
+            if(!listfile[k]) { continue; }
+            fprinthexdigest(listfile[k],
+                digest_bytes(&d, hashlists[k].digest), hashlists[k].size
+            );
+            fprintf(listfile[k], "  %s\n", filename[i]);
+        }
         nfiles_done++;
     }
     printf(
@@ -204,103 +996,310 @@ error:
 
 done:
     if(sfvfile != NULL) { fclose(sfvfile); }
+    if(entry   != NULL) { free(entry); }
+    for(k = 0; k < NHASHLISTS; k++) {
+        if(listfile[k] != NULL) { fclose(listfile[k]); }
+    }
 
     return nerrors;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Parse one line of a SFV or checksum list in place
+// Returns the filename, or NULL if the line should be ignored
+//
+static char* parse_sfv_line(
+    char                  *line,
+    size_t                 len,
+    const struct hashlist *list,
+    struct digests        *expect
+) {
+    const char *nul = memchr(line, 0, len);
+    size_t i;
+    if(nul) { len = nul - line; }
+    while(len && usfv_isspace(line[0])) { line++; len--; }
+    while(len && usfv_isspace(line[len - 1])) { len--; }
+    // Skip blank lines and comments
+    if(!len || line[0] == ';') { return NULL; }
+    line[len] = 0;
+    if(list) {
+        //
+        // "digest  filename", or "digest *filename" for binary mode
+        //
+        size_t hexlen = 2 * list->size;
+        if(
+            len < hexlen + 3 ||
+            parse_hex_digest(
+                line, digest_bytes(expect, list->digest), list->size
+            ) ||
+            line[hexlen] != ' ' ||
+            (line[hexlen + 1] != ' ' && line[hexlen + 1] != '*')
+        ) {
+            return NULL;
+        }
+        return line + hexlen + 2;
+    }
+    i = len;
+    while(i && !usfv_isspace(line[i - 1])) { i--; }
+    expect->crc = strtoul(line + i, NULL, 16);
+    while(i && usfv_isspace(line[i - 1])) { i--; }
+    // No filename? just one thing on a line? ignore it
+    if(!i) { return NULL; }
+    line[i] = 0;
+    return line;
+}
+
+//
+// Read every entry from a SFV or checksum list
+//
+// The file is read in large blocks and each line is parsed where it lies, so
+// only the filenames are copied out.
+//
+// Returns nonzero on error
+//
+static int read_sfv(
+    FILE                  *f,
+    const char            *sfvfilename,
+    const struct hashlist *list,
+    struct sfventry      **entry_out,
+    size_t                *n_out
+) {
+    char *buf = NULL;
+    size_t bufsize = 0x8000;    // not counting the extra byte for a NUL
+    struct sfventry *entry = *entry_out;
+    size_t nentries = *n_out;
+    size_t entries_size = nentries;
+    size_t start = 0;
+    size_t have = 0;
+    int eof = 0;
+    buf = malloc(bufsize + 1);
+    if(!buf) {
+        printf("Out of memory\n");
+        goto error;
+    }
+    for(;;) {
+        struct digests expect;
+        char *line = buf + start;
+        char *nl = memchr(line, '\n', have - start);
+        char *name;
+        size_t len;
+        if(!nl) {
+            if(!eof) {
+                //
+                // Keep the partial line and read more
+                //
+                size_t r;
+                memmove(buf, line, have - start);
+                have -= start;
+                start = 0;
+                if(have >= bufsize) {
+                    //
+                    // The line doesn't fit; make room for a longer one
+                    //
+                    char *newbuf;
+                    if(bufsize > ((size_t)(-1)) / 2 - 1) {
+                        printf("Out of memory\n");
+                        goto error;
+                    }
+                    newbuf = realloc(buf, 2 * bufsize + 1);
+                    if(!newbuf) {
+                        printf("Out of memory\n");
+                        goto error;
+                    }
+                    buf = newbuf;
+                    bufsize *= 2;
+                }
+                r = fread(buf + have, 1, bufsize - have, f);
+                if(r == 0) {
+                    if(ferror(f)) {
+                        printfileerror(f, sfvfilename);
+                        goto error;
+                    }
+                    eof = 1;
+                }
+                have += r;
+                continue;
+            }
+            if(start == have) { break; }
+            nl = buf + have;
+        }
+        len = nl - line;
+        start += len;
+        if(start < have) { start++; }
+        name = parse_sfv_line(line, len, list, &expect);
+        if(!name) { continue; }
+        //
+        // Add it to the list
+        //
+        if(nentries >= entries_size) {
+            size_t newsize = entries_size ? 2 * entries_size : 64;
+            struct sfventry *newentry;
+            if(
+                newsize < entries_size ||
+                newsize > (((size_t)(-1)) / sizeof(*entry))
+            ) {
+                printf("Out of memory\n");
+                goto error;
+            }
+            newentry = realloc(entry, newsize * sizeof(*entry));
+            if(!newentry) {
+                printf("Out of memory\n");
+                goto error;
+            }
+            entry = newentry;
+            entries_size = newsize;
+        }
+        len = strlen(name);
+        memset(entry + nentries, 0, sizeof(*entry));
+        entry[nentries].expect = expect;
+        entry[nentries].index  = nentries;
+        entry[nentries].name   = malloc(len + 1);
+        if(!entry[nentries].name) {
+            printf("Out of memory\n");
+            goto error;
+        }
+        memcpy(entry[nentries].name, name, len + 1);
+        nentries++;
+    }
+    free(buf);
+    *entry_out = entry;
+    *n_out     = nentries;
+    return 0;
+
+error:
+    if(buf) { free(buf); }
+    *entry_out = entry;
+    *n_out     = nentries;
+    return 1;
+}
+
+//
+// Inode order is a cheap stand-in for where files lie on disk
+//
+static int sfventry_compare_location(const void *a, const void *b) {
+    const struct sfventry *x = (const struct sfventry*)a;
+    const struct sfventry *y = (const struct sfventry*)b;
+    if(x->dev   != y->dev  ) { return (x->dev   < y->dev  ) ? -1 : 1; }
+    if(x->ino   != y->ino  ) { return (x->ino   < y->ino  ) ? -1 : 1; }
+    if(x->index != y->index) { return (x->index < y->index) ? -1 : 1; }
+    return 0;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Returns the number of errors
 //
+// Files are read in inode order, but still reported in the order they're
+// listed.
+//
 static off_t sfvverify(
-    char *sfvfilename
+    char *sfvfilename,
+    size_t depth,
+    struct crccache *cache
 ) {
     off_t returncode = 0;
     FILE *sfvfile  = NULL;
-    char *filename = NULL;
+    struct sfventry *entry = NULL;
+    size_t *slot = NULL;
 
-    int filename_size = 0;
+    size_t nentries = 0;
+    size_t n;
+    size_t nreported = 0;
     size_t nfiles = 0;
     size_t nfiles_ok = 0;
     size_t nfiles_bad = 0;
     size_t nfiles_err = 0;
+    const struct hashlist *list = get_hashlist(sfvfilename);
+    int which = list ? list->digest : DIGEST_CRC32;
 
     sfvfile = fopen(sfvfilename, "rb");
     if(!sfvfile) { goto error_sfvfile; }
-    printf("Verifying SFV file %s\n", sfvfilename);
-    for(;;) {
-        int c, i, filename_len;
-        const char *crcstr;
-        uint32_t crcnum, filecrcnum;
-        do { c = fgetc(sfvfile); } while(c != EOF && usfv_isspace(c));
-        if(c == EOF) { break; }
-        // Skip comments
-        if(c == ';') {
-            do { c = fgetc(sfvfile); } while(c != EOF && c != '\n');
-            if(c == EOF) { break; }
-            continue;
+    printf("Verifying %s file %s\n", list ? list->title : "SFV", sfvfilename);
+    if(read_sfv(sfvfile, sfvfilename, list, &entry, &nentries)) {
+        goto error;
+    }
+    fclose(sfvfile);
+    sfvfile = NULL;
+    //
+    // Sort by location, remembering where each entry went
+    //
+    for(n = 0; n < nentries; n++) {
+        stat_entry(entry + n);
+    }
+    qsort(entry, nentries, sizeof(*entry), sfventry_compare_location);
+    if(nentries) {
+        if(nentries > (((size_t)(-1)) / sizeof(*slot))) {
+            printf("Out of memory\n");
+            goto error;
+        }
+        slot = malloc(nentries * sizeof(*slot));
+        if(!slot) {
+            printf("Out of memory\n");
+            goto error;
         }
-        // Assume this is a filename
-        filename_len = 0;
-        for(;;) {
-            if((filename_len + 1) >= filename_size) {
-                if(filename_size > BIG_FILENAME_SIZE) {
-                    fflush(stdout);
-                    printf("Corrupt SFV file\n");
-                    goto error;
+    }
+    for(n = 0; n < nentries; n++) {
+        slot[entry[n].index] = n;
+    }
+    //
+    // Now check every file in the list
+    //
+    for(n = 0; n < nentries; n++) {
+        readahead(entry, nentries, n, depth);
+        if(getdigests(cache, entry + n, which, &(entry[n].actual))) {
+            entry[n].error  = errno;
+            entry[n].failed = 1;
+        }
+        entry[n].done = 1;
+        //
+        // Report everything that's done, up to the first file that isn't
+        //
+        while(nreported < nentries && entry[slot[nreported]].done) {
+            struct sfventry *e = entry + slot[nreported++];
+            printf("%-22s ", e->name);
+            if(e->failed) {
+                nfiles_err++;
+                printf("%s\n", strerror(e->error));
+                continue;
+            }
+            nfiles++;
+            if(list) {
+                const uint8_t *actual = digest_bytes(&(e->actual), which);
+                const uint8_t *wanted = digest_bytes(&(e->expect), which);
+                if(!memcmp(actual, wanted, list->size)) {
+                    nfiles_ok++;
+                    printf("ok\n");
+                } else {
+                    nfiles_bad++;
+                    printf("*** BAD *** (");
+                    fprinthexdigest(stdout, actual, list->size);
+                    printf(", should be ");
+                    fprinthexdigest(stdout, wanted, list->size);
+                    printf(")\n");
                 }
-                filename_size += 100;
-                filename = realloc(filename, filename_size);
-                if(!filename) {
-                    printf("Out of memory\n");
-                    goto error;
+            } else {
+                uint32_t filecrcnum = e->actual.crc;
+                uint32_t crcnum     = e->expect.crc;
+                if(filecrcnum == crcnum) {
+                    nfiles_ok++;
+                    printf("ok\n");
+                } else {
+                    nfiles_bad++;
+                    printf(
+                        "*** BAD *** (%02X%02X%02X%02X, "
+                        "should be %02X%02X%02X%02X)\n",
+                        (int)((filecrcnum >> 24) & 0xFF),
+                        (int)((filecrcnum >> 16) & 0xFF),
+                        (int)((filecrcnum >>  8) & 0xFF),
+                        (int)((filecrcnum >>  0) & 0xFF),
+                        (int)((    crcnum >> 24) & 0xFF),
+                        (int)((    crcnum >> 16) & 0xFF),
+                        (int)((    crcnum >>  8) & 0xFF),
+                        (int)((    crcnum >>  0) & 0xFF)
+                    );
                 }
             }
-            filename[filename_len++] = c;
-            if(!c) { break; }
-            c = fgetc(sfvfile);
-            if(c == EOF || c == '\n') {
-                c = 0;
-            }
-        }
-        filename_len--;
-        while(filename_len && usfv_isspace(filename[filename_len - 1])) {
-            filename_len--;
-        }
-        filename[filename_len] = 0;
-        i = filename_len;
-        while(i && !usfv_isspace(filename[i - 1])) { i--; }
-        crcstr = filename + i;
-        while(i && usfv_isspace(filename[i - 1])) { i--; }
-        // No filename? just one thing on a line? ignore it
-        if(!i) { continue; }
-        filename[i] = 0;
-        crcnum = strtoul(crcstr, NULL, 16);
-        printf("%-22s ", filename);
-        fflush(stdout);
-        filecrcnum = 0;
-        i = getfilecrc(filename, &filecrcnum);
-        if(i) {
-            nfiles_err++;
-            printf("%s\n", strerror(errno));
-            continue;
-        }
-        nfiles++;
-        if(filecrcnum == crcnum) {
-            nfiles_ok++;
-            printf("ok\n");
-        } else {
-            nfiles_bad++;
-            printf("*** BAD *** (%02X%02X%02X%02X, should be %02X%02X%02X%02X)\n",
-                (int)((filecrcnum >> 24) & 0xFF),
-                (int)((filecrcnum >> 16) & 0xFF),
-                (int)((filecrcnum >>  8) & 0xFF),
-                (int)((filecrcnum >>  0) & 0xFF),
-                (int)((    crcnum >> 24) & 0xFF),
-                (int)((    crcnum >> 16) & 0xFF),
-                (int)((    crcnum >>  8) & 0xFF),
-                (int)((    crcnum >>  0) & 0xFF)
-            );
         }
     }
     printf(
@@ -324,7 +1323,13 @@ error:
 
 done:
     if(sfvfile  != NULL) { fclose(sfvfile); }
-    if(filename != NULL) { free(filename); }
+    if(slot     != NULL) { free(slot); }
+    if(entry    != NULL) {
+        for(n = 0; n < nentries; n++) {
+            free(entry[n].name);
+        }
+        free(entry);
+    }
 
     return returncode;
 }
@@ -335,30 +1340,105 @@ int main(
     int argc,
     char **argv
 ) {
+    size_t depth = 1;
+    const char *cachefilename = NULL;
+    const char *listfilename[NHASHLISTS];
+    struct crccache cache;
+    off_t returncode;
+    char cmd;
+    int i;
+
     normalize_argv0(argv[0]);
+    memset(listfilename, 0, sizeof(listfilename));
 
     tzset();
+    crc_init();
+    if(argc < 3 || argv[1][0] == 0 || argv[1][1] != 0) {
+        goto usage;
+    }
+    cmd = argv[1][0];
+    if(cmd != 'c' && cmd != 'v') {
+        goto usage;
+    }
+    //
+    // Options
+    // Anything else starting with '-' is taken as a file name, and "--" ends
+    // the options for file names that look like options
+    //
+    for(i = 2; i < argc && argv[i][0] == '-'; i++) {
+        if(!strcmp(argv[i], "--")) {
+            i++;
+            break;
+        } else if(!strcmp(argv[i], "-j") && (i + 1) < argc) {
+            char *end;
+            unsigned long j = strtoul(argv[++i], &end, 10);
+            if(*end || j < 1) {
+                printf("Error: Invalid -j value: %s\n", argv[i]);
+                return 1;
+            }
+            depth = j;
+        } else if(!strcmp(argv[i], "-cache") && (i + 1) < argc) {
+            cachefilename = argv[++i];
+        } else if(!strcmp(argv[i], "-md5") && (i + 1) < argc) {
+            listfilename[0] = argv[++i];
+        } else if(!strcmp(argv[i], "-sha256") && (i + 1) < argc) {
+            listfilename[1] = argv[++i];
+        } else {
+            break;
+        }
+    }
     if(
-        (argc < 3) ||
-        (argv[1][0] == 0) ||
-        (argv[1][1] != 0) ||
-        (argv[1][0] != 'c' && argv[1][0] != 'v') ||
-        (argv[1][0] == 'c' && argc == 3) ||
-        (argv[1][0] == 'v' && argc > 3)
+        (i >= argc) ||
+        (cmd == 'c' && (i + 1) >= argc) ||
+        (cmd == 'v' && (i + 1) <  argc)
     ) {
-        banner();
-        printf(
-            "Usage:\n"
-            "To create a SFV file: %s c sfvfile filenames\n"
-            "To verify a SFV file: %s v sfvfile\n", argv[0], argv[0]
-        );
-        return 1;
+        goto usage;
+    }
+    if(cachefilename) {
+        if(cache_load(&cache, cachefilename)) {
+            return 1;
+        }
+    } else {
+        memset(&cache, 0, sizeof(cache));
     }
-    if(argv[1][0] == 'c') {
-        return sfvcreate(argv[2], argv + 3, argc - 3);
+    if(cmd == 'c') {
+        returncode = sfvcreate(
+            argv[i], argv + i + 1, argc - i - 1, depth, &cache, listfilename
+        );
     } else {
-        return sfvverify(argv[2]);
+        returncode = sfvverify(argv[i], depth, &cache);
+    }
+    if(cachefilename) {
+        if(cache.nhits) {
+            printf("%lu CRC%s taken from cache\n",
+                (unsigned long)cache.nhits, cache.nhits == 1 ? "" : "s"
+            );
+        }
+        if(cache_save(&cache)) {
+            returncode = 1;
+        }
+        cache_free(&cache);
     }
+    return returncode;
+
+usage:
+    banner();
+    printf(
+        "Usage:\n"
+        "To create a SFV file: %s c [options] sfvfile filenames\n"
+        "To verify a SFV file: %s v [options] sfvfile\n"
+        "  (a .md5 or .sha256 file is verified as an md5sum/sha256sum list)\n"
+        "Options:\n"
+        "  -j n          Have the OS read ahead, up to n files per device\n"
+        "                including the current one\n"
+        "  -cache file   Remember CRCs in a cache file, and skip rereading\n"
+        "                files that haven't changed\n"
+        "  -md5 file     When creating, also write an MD5 list\n"
+        "  -sha256 file  When creating, also write a SHA-256 list\n"
+        "  --            End of options\n",
+        argv[0], argv[0]
+    );
+    return 1;
 }
 
 ////////////////////////////////////////////////////////////////////////////////